@@ -1,4 +1,5 @@
 #include "Compiler.h"
+#include "../vm/globals.h"
 
 namespace ASM {
   M64 Compiler::current_closure() {
@@ -228,21 +229,248 @@ namespace ASM {
     dead(r2);
   }
 
+  // Globals live at fixed addresses in interpreter->globals, and Glob::num is the slot
+  M64 Compiler::global_slot(shared_ptr<Glob> glob, const R64& reg) {
+    assm.mov(reg, Imm64{(uint64_t) &interpreter->globals[glob->num]});
+    return M64{reg, Imm32{0}};
+  }
+
   void Compiler::assign_glob(shared_ptr<Glob> src, shared_ptr<Temp> dest) {
-    assign_helper_call_to_temp(dest, (void *)(&helper_read_global), src->num);
+    x64asm::Label initialized;
+    auto reg = alloc_reg();
+    assm.mov(reg, global_slot(src, reg));
+    assm.cmp(reg, Imm32{_UNINITIALIZED_VALUE});
+    write_temp(dest, reg);
+    dead(reg);
+    assm.jne_1(initialized);
+    prepare_call_helper(1);
+    auto s1 = rdi;
+    assm.mov(s1, Imm64{src->num});
+    call_helper((void *)(&helper_throw_uninitialized_global), s1);
+    dead(s1);
+    assm.bind(initialized);
   }
 
   void Compiler::store_glob(shared_ptr<Temp> src, shared_ptr<Glob> dest) {
-    prepare_call_helper(3);
-    auto reg = rdi;
-    assm.mov(reg, current_closure());
-    auto r2 = rsi;
-    assm.mov(r2, Imm64{dest->num});
-    auto r3 = read_temp(src, rdx);
-    call_helper((void *)(&helper_write_global), reg, r2, r3);
+    auto reg = alloc_reg();
+    auto slot = global_slot(dest, reg);
+    auto s1 = read_temp(src);
+    assm.mov(slot, s1);
+    dead(s1);
     dead(reg);
-    dead(r2);
-    dead(r3);
+  }
+
+  // Checks that record holds a RecordValue, jumping to miss otherwise
+  void Compiler::check_record(const R64& record, x64asm::Label& miss) {
+    auto scratch = alloc_reg();
+    assm.mov(scratch, record);
+    assm.and_(scratch, Imm32{_VALUE_MASK});
+    assm.cmp(scratch, Imm32{_POINTER_TAG});
+    assm.jne_1(miss);
+    dead(scratch);
+    assm.cmp(M8{record, Imm32{(uint32_t) (VM::PointerValue::kind_offset - _POINTER_TAG)}}, Imm8{(uint8_t) VM::PointerKind::Record});
+    assm.jne_1(miss);
+  }
+
+  // Fast path of a field access: checks that record holds a RecordValue whose
+  // shape is in the site's inline cache and leaves the field's inline slot in
+  // slot, or jumps to miss. record is left untouched for the helper.
+  void Compiler::record_slot(const R64& record, const R64& slot, BC::FieldCache* cache, x64asm::Label& miss) {
+    x64asm::Label found;
+    check_record(record, miss);
+    auto shape = alloc_reg();
+    assm.mov(shape, M64{record, Imm32{(uint32_t) (VM::RecordValue::shape_offset - _POINTER_TAG)}});
+    assm.test(shape, shape);
+    assm.je_1(miss);
+    assm.mov(slot, Imm64{(uint64_t) cache});
+    for (size_t i = 0; i < FIELD_CACHE_SIZE; i++) {
+      x64asm::Label next;
+      assm.cmp(shape, M64{slot, Imm32{(uint32_t) (offsetof(BC::FieldCache, shapes) + i * sizeof(VM::Shape*))}});
+      assm.jne_1(next);
+      assm.mov(slot, M64{slot, Imm32{(uint32_t) (offsetof(BC::FieldCache, slots) + i * sizeof(int64_t))}});
+      assm.jmp_1(found);
+      assm.bind(next);
+    }
+    assm.jmp_1(miss);
+    assm.bind(found);
+    dead(shape);
+    // Also rejects missing fields (-1), overflow slots and, for stores, transitions
+    assm.cmp(slot, Imm32{RECORD_INLINE_SLOTS});
+    assm.jae_1(miss);
+  }
+
+  void Compiler::field_load(CallHelper<Helper::FieldLoad>* op) {
+    x64asm::Label miss, done;
+    auto cache = (BC::FieldCache*) op->arg0;
+    prepare_call_helper(2);
+    auto s1 = rdi;
+    auto s2 = read_temp(op->args[0], rsi);
+    record_slot(s2, s1, cache, miss);
+    // Leave the field in rax, where the helper would have returned it
+    assm.mov(rax, M64{s2, s1, Scale::TIMES_8, Imm32{(uint32_t) (VM::RecordValue::slots_offset - _POINTER_TAG)}});
+    assm.jmp_1(done);
+    assm.bind(miss);
+    assm.mov(s1, Imm64{(uint64_t) cache});
+    call_helper((void *)(&helper_field_load), s1, s2);
+    dead(s1);
+    dead(s2);
+    assm.bind(done);
+  }
+
+  void Compiler::field_store(CallHelper<Helper::FieldStore>* op) {
+    x64asm::Label miss, done;
+    auto cache = (BC::FieldCache*) op->arg0;
+    prepare_call_helper(3);
+    auto s1 = rdi;
+    auto s2 = read_temp(op->args[0], rsi);
+    auto s3 = read_temp(op->args[1], rdx);
+    record_slot(s2, s1, cache, miss);
+    assm.mov(M64{s2, s1, Scale::TIMES_8, Imm32{(uint32_t) (VM::RecordValue::slots_offset - _POINTER_TAG)}}, s3);
+    if (has_optimization(OPTIMIZATION_GC_GENERATIONAL)) {
+      // The write barrier: storing a pointer dirties the card the record
+      // starts on (see GC::Page)
+      x64asm::Label clean;
+      auto card = alloc_reg();
+      auto page = alloc_reg();
+      assm.mov(card, s3);
+      assm.and_(card, Imm32{_POINTER_TAG});
+      assm.je_1(clean);
+      assm.mov(card, s2);
+      assm.shr(card, Imm8{GC::Page::CARD_SHIFT});
+      assm.and_(card, Imm32{GC::Page::CARDS - 1});
+      assm.mov(page, s2);
+      assm.and_(page, Imm32{(uint32_t) ~(GC::Page::BYTES - 1)});
+      assm.mov(M8{page, card, Scale::TIMES_1, Imm32{(uint32_t) GC::Page::cards_offset}}, Imm8{1});
+      assm.bind(clean);
+      dead(card);
+      dead(page);
+    }
+    assm.jmp_1(done);
+    assm.bind(miss);
+    assm.mov(s1, Imm64{(uint64_t) cache});
+    call_helper((void *)(&helper_field_store), s1, s2, s3);
+    dead(s1);
+    dead(s2);
+    dead(s3);
+    assm.bind(done);
+  }
+
+  // Integer indices below element_count are read straight out of the record's elements
+  void Compiler::index_load(CallHelper<Helper::IndexLoad>* op) {
+    x64asm::Label miss, done;
+    prepare_call_helper(2);
+    auto s1 = read_temp(op->args[0], rdi);
+    auto s2 = read_temp(op->args[1], rsi);
+    assm.test(s2, Imm32{_VALUE_MASK});
+    assm.jne_1(miss);
+    check_record(s1, miss);
+    auto index = alloc_reg();
+    assm.mov(index, s2);
+    assm.sar(index, Imm8{3});
+    // Negative indices compare as huge unsigned values and miss as well
+    assm.cmp(index, M64{s1, Imm32{(uint32_t) (VM::RecordValue::element_count_offset - _POINTER_TAG)}});
+    assm.jae_1(miss);
+    auto elements = alloc_reg();
+    assm.mov(elements, M64{s1, Imm32{(uint32_t) (VM::RecordValue::elements_offset - _POINTER_TAG)}});
+    assm.mov(rax, M64{elements, index, Scale::TIMES_8});
+    dead(index);
+    dead(elements);
+    assm.jmp_1(done);
+    assm.bind(miss);
+    call_helper((void *)(&helper_index_load), s1, s2);
+    dead(s1);
+    dead(s2);
+    assm.bind(done);
+  }
+
+  // Equal words are equal values, and different words are unequal unless both
+  // are strings. Constants are interned, so two of them differ too: only the
+  // remaining pairs of strings are compared by the helper
+  void Compiler::equals(Eq* eq) {
+    x64asm::Label slow, unequal, done;
+    prepare_call_helper(2);
+    auto s1 = read_temp(eq->src1, rdi);
+    auto s2 = read_temp(eq->src2, rsi);
+    assm.mov(rax, Imm32{(uint32_t) (0b1000 | _BOOLEAN_TAG)});
+    assm.cmp(s1, s2);
+    assm.je_1(done);
+    auto tag = alloc_reg();
+    auto strings = alloc_reg();
+    assm.mov(strings, Imm32{_STRING_TAGS});
+    assm.mov(tag, s2);
+    assm.and_(tag, Imm32{_VALUE_MASK});
+    assm.bt(strings, tag);
+    assm.jae_1(unequal);
+    assm.mov(tag, s1);
+    assm.and_(tag, Imm32{_VALUE_MASK});
+    assm.bt(strings, tag);
+    assm.jae_1(unequal);
+    assm.cmp(tag, Imm32{_STRING_CONSTANT_TAG});
+    assm.jne_1(slow);
+    assm.mov(tag, s2);
+    assm.and_(tag, Imm32{_VALUE_MASK});
+    assm.cmp(tag, Imm32{_STRING_CONSTANT_TAG});
+    assm.je_1(unequal);
+    assm.bind(slow);
+    dead(tag);
+    dead(strings);
+    call_helper((void *)(&helper_equals), s1, s2);
+    dead(s1);
+    dead(s2);
+    assm.jmp_1(done);
+    assm.bind(unequal);
+    assm.mov(rax, Imm32{(uint32_t) _BOOLEAN_TAG});
+    assm.bind(done);
+  }
+
+  // Calls with one argument check for the intcast builtin first and parse the
+  // string directly, skipping the argument list and builtin dispatch.
+  void Compiler::call_function(IR::Call* call) {
+    x64asm::Label generic, done;
+    if (call->args.size() == 1) {
+      auto saved_live = live;
+      auto saved_shared = shared;
+      prepare_call_helper(1);
+      auto closure = read_temp(call->closure);
+      auto scratch = alloc_reg();
+      assm.mov(scratch, closure);
+      assm.and_(scratch, Imm32{_VALUE_MASK});
+      assm.cmp(scratch, Imm32{_POINTER_TAG});
+      assm.jne(generic);
+      dead(scratch);
+      assm.cmp(M8{closure, Imm32{(uint32_t) (VM::PointerValue::kind_offset - _POINTER_TAG)}}, Imm8{(uint8_t) VM::PointerKind::BuiltInFunction});
+      assm.jne(generic);
+      assm.cmp(M32{closure, Imm32{(uint32_t) (VM::BuiltInFunctionValue::type_offset - _POINTER_TAG)}}, Imm32{(uint32_t) VM::BuiltInFunctionType::Intcast});
+      assm.jne(generic);
+      dead(closure);
+      auto s1 = read_temp(call->args[0], rdi);
+      call_helper((void *)(&helper_intcast), s1);
+      dead(s1);
+      assm.jmp(done);
+      live = saved_live;
+      shared = saved_shared;
+      assm.bind(generic);
+    }
+    prepare_call_helper(3);
+    for (int i = call->args.size() - 1; i >= 0; --i) {
+      auto s = read_temp(call->args[i]);
+      assm.push(s);
+      pushed_words++;
+      dead(s);
+    }
+    auto s1 = read_temp(call->closure, rdi);
+    auto s2 = alloc_reg();
+    auto s3 = rdx;
+    assm.mov(s2, rsp);
+    assm.mov(s3, Imm32{(uint32_t)call->args.size()});
+    flush_vars();
+    call_helper((void *)(&helper_call_function), s1, s2, s3);
+    dead(s1);
+    dead(s2);
+    dead(s3);
+    assm.add(rsp, Imm32{(uint32_t)call->args.size()*STACK_VALUE_SIZE});
+    pushed_words -= call->args.size();
+    assm.bind(done);
   }
 
   void Compiler::assign_function(shared_ptr<IR::Function> src, shared_ptr<Temp> dest) {
@@ -339,13 +567,24 @@ namespace ASM {
     assm.mov(scratch, Imm64{(uint64_t)fn});
     dead(scratch);
 
+    size_t pushed = pushed_words;
     for (auto reg : caller_saved_regs) {
       if (is_alive(reg)) {
         assm.push(reg);
+        pushed++;
       }
     }
 
+    // The frame leaves rsp 16 byte aligned, and helpers need it to stay so
+    // at the call, or the collector's SSE spills fault
+    bool pad = pushed % 2 == 1;
+    if (pad) {
+      assm.sub(rsp, Imm32{STACK_VALUE_SIZE});
+    }
     assm.call(scratch);
+    if (pad) {
+      assm.add(rsp, Imm32{STACK_VALUE_SIZE});
+    }
 
     for (auto rit = caller_saved_regs.rbegin(); rit != caller_saved_regs.rend(); ++rit) {
       if (is_alive(*rit)) {
@@ -401,7 +640,11 @@ namespace ASM {
     assm.push(r14);
     assm.push(r15);
 
-    assm.sub(rsp, Imm32{((uint32_t)num_temps + RESERVED_STACK_SPACE)*STACK_VALUE_SIZE});
+    // Entered with rsp 16 byte aligned less the return address, so after six
+    // pushes an odd number of words realigns it
+    uint32_t frame_words = (uint32_t)num_temps + RESERVED_STACK_SPACE;
+    frame_words |= 1;
+    assm.sub(rsp, Imm32{frame_words*STACK_VALUE_SIZE});
     assm.mov(current_closure(), rdi);
     assm.mov(current_locals_reg, rsi);
     assm.mov(current_refs(), rdx);
@@ -562,12 +805,7 @@ namespace ASM {
         }
         case IR::Operation::Eq: {
           auto eq = dynamic_cast<Eq*>(instruction);
-          prepare_call_helper(2);
-          auto s1 = read_temp(eq->src1, rdi);
-          auto s2 = read_temp(eq->src2, rsi);
-          call_helper((void *)(&helper_equals), s1, s2);
-          dead(s1);
-          dead(s2);
+          equals(eq);
           write_temp(eq->dest, rax);
           break;
         }
@@ -619,24 +857,7 @@ namespace ASM {
           break;
         }
         case IR::Operation::Call: {
-          auto call = dynamic_cast<IR::Call*>(instruction);
-          prepare_call_helper(3);
-          for (int i = call->args.size() - 1; i >= 0; --i) {
-            auto s = read_temp(call->args[i]);
-            assm.push(s);
-            dead(s);
-          }
-          auto s1 = read_temp(call->closure, rdi);
-          auto s2 = alloc_reg();
-          auto s3 = rdx;
-          assm.mov(s2, rsp);
-          assm.mov(s3, Imm32{(uint32_t)call->args.size()});
-          flush_vars();
-          call_helper((void *)(&helper_call_function), s1, s2, s3);
-          dead(s1);
-          dead(s2);
-          dead(s3);
-          assm.add(rsp, Imm32{(uint32_t)call->args.size()*STACK_VALUE_SIZE});
+          call_function(dynamic_cast<IR::Call*>(instruction));
           break;
         }
         case IR::Operation::Return: {
@@ -662,36 +883,11 @@ namespace ASM {
             prepare_call_helper(0);
             call_helper((void *)(&helper_alloc_record));
           } else if (auto op = dynamic_cast<CallHelper<Helper::FieldLoad>*>(instruction)) {
-            prepare_call_helper(3);
-            auto s1 = rdi;
-            assm.mov(s1, current_closure());
-            auto s2 = read_temp(op->args[0], rsi);
-            auto s3 = rdx;
-            assm.mov(s3, Imm64{op->arg0});
-            call_helper((void *)(&helper_field_load), s1, s2, s3);
-            dead(s1);
-            dead(s2);
-            dead(s2);
+            field_load(op);
           } else if (auto op = dynamic_cast<CallHelper<Helper::FieldStore>*>(instruction)) {
-            prepare_call_helper(4);
-            auto s1 = rdi;
-            assm.mov(s1, current_closure());
-            auto s2 = read_temp(op->args[0], rsi);
-            auto s3 = rdx;
-            assm.mov(s3, Imm64{op->arg0});
-            auto s4 = read_temp(op->args[1], rcx);
-            call_helper((void *)(&helper_field_store), s1, s2, s3, s4);
-            dead(s1);
-            dead(s2);
-            dead(s3);
-            dead(s4);
+            field_store(op);
           } else if (auto op = dynamic_cast<CallHelper<Helper::IndexLoad>*>(instruction)) {
-            prepare_call_helper(2);
-            auto s1 = read_temp(op->args[0], rdi);
-            auto s2 = read_temp(op->args[1], rsi);
-            call_helper((void *)(&helper_index_load), s1, s2);
-            dead(s1);
-            dead(s2);
+            index_load(op);
           } else if (auto op = dynamic_cast<CallHelper<Helper::IndexStore>*>(instruction)) {
             prepare_call_helper(3);
             auto s1 = read_temp(op->args[0], rdi);
@@ -41,6 +41,8 @@ namespace ASM {
   class Compiler {
     size_t ir_count = 0;
     size_t num_temps;
+    // Words pushed below the frame for the arguments of a call being made
+    size_t pushed_words = 0;
     IR::InstructionList& ir;
     Assembler assm;
     unordered_set<size_t> live;
@@ -76,8 +78,16 @@ namespace ASM {
     void assign_ref(shared_ptr<Ref> src, shared_ptr<Temp> dest);
     void assign_deref(shared_ptr<Deref> src, shared_ptr<Temp> dest);
     void store_deref(shared_ptr<Temp> src, shared_ptr<Deref> dest);
+    M64 global_slot(shared_ptr<Glob> glob, const R64& reg);
     void assign_glob(shared_ptr<Glob> src, shared_ptr<Temp> dest);
     void store_glob(shared_ptr<Temp> src, shared_ptr<Glob> dest);
+    void check_record(const R64& record, x64asm::Label& miss);
+    void record_slot(const R64& record, const R64& slot, BC::FieldCache* cache, x64asm::Label& miss);
+    void field_load(IR::CallHelper<IR::Helper::FieldLoad>* op);
+    void field_store(IR::CallHelper<IR::Helper::FieldStore>* op);
+    void index_load(IR::CallHelper<IR::Helper::IndexLoad>* op);
+    void equals(IR::Eq* eq);
+    void call_function(IR::Call* call);
     void assign_function(shared_ptr<IR::Function> src, shared_ptr<Temp> dest);
     void extract_bits(shared_ptr<Temp> temp, const R64& dest, size_t start, size_t length);
     R64 read_temp(shared_ptr<Temp> temp, optional<R64> reg_hint = nullopt, bool scratch = false, bool force = false);
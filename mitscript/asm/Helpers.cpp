@@ -27,6 +27,13 @@ namespace ASM {
     return Value::makePointer(interpreter->heap.allocate<RecordValue>()).value;
   }
 
+  uint64_t helper_intcast(uint64_t value) {
+    #if DEBUG
+      cout << endl << "helper_intcast" << endl;
+    #endif
+    return intcast(Value(value)).value;
+  }
+
   uint64_t helper_call_function(uint64_t closure_p, Value* args, int argc) {
     #if DEBUG
       cout << endl << "helper_call_function" << endl;
@@ -39,33 +46,7 @@ namespace ASM {
       cout << "Index: " << argc << endl;
     #endif
     AbstractFunctionValue* closure = Value(closure_p).getPointer<AbstractFunctionValue>();
-    std::vector<Value> values;
-    for (size_t i = 0; i < argc; ++i) {
-      values.push_back(args[i]);
-    }
-    return closure->call(values).value;
-  }
-
-  uint64_t helper_read_global(ClosureFunctionValue* closure, int index) {
-    std::string name = closure->value->names_[index];
-    #if DEBUG
-      cout << endl << "helper_read_global" << endl;
-      cout << "Closure: " << (void*) closure << endl;
-      cout << "name: " << name << endl;
-      cout << "value: " << Value(interpreter->global_variables[name].value).toString() << endl;
-    #endif
-    return interpreter->global_variables[name].value;
-  }
-
-  void helper_write_global(ClosureFunctionValue* closure, int index, uint64_t value) {
-    std::string name = closure->value->names_[index];
-    #if DEBUG
-      cout << endl << "helper_write_global" << endl;
-      cout << "Closure: " << (void*) closure << endl;
-      cout << "name: " << name << endl;
-      cout << "value: " << Value(value).toString() << endl;
-    #endif
-    interpreter->global_variables[name].value = value;
+    return closure->call(args, argc).value;
   }
 
   uint64_t helper_read_reference(uint64_t reference_p) {
@@ -90,20 +71,20 @@ namespace ASM {
     return allocateFunction(closure, index).value;
   }
 
-  uint64_t helper_field_load(ClosureFunctionValue* closure, uint64_t record_p, int index) {
+  uint64_t helper_field_load(BC::FieldCache* cache, uint64_t record_p) {
     #if DEBUG
-      cout << endl << "helper_field_load" << " Name: " << closure->value->names_[index] << endl;
+      cout << endl << "helper_field_load" << " Name: " << cache->name << endl;
     #endif
     RecordValue* record = Value(record_p).getPointer<RecordValue>();
-    return record->get(closure->value->names_[index]).value;
+    return record->get(*cache).value;
   }
 
-  void helper_field_store(ClosureFunctionValue* closure, uint64_t record_p, int index, uint64_t value) {
+  void helper_field_store(BC::FieldCache* cache, uint64_t record_p, uint64_t value) {
     #if DEBUG
-      cout << endl << "helper_field_store" << " Name: " << closure->value->names_[index] << endl;
+      cout << endl << "helper_field_store" << " Name: " << cache->name << endl;
     #endif
     RecordValue* record = Value(record_p).getPointer<RecordValue>();
-    record->insert(closure->value->names_[index], Value(value));
+    record->insert(*cache, Value(value));
   }
 
   uint64_t helper_index_load(uint64_t record_p, uint64_t index) {
@@ -111,7 +92,7 @@ namespace ASM {
       cout << endl << "helper_index_load" << endl;
     #endif
     RecordValue* record = Value(record_p).getPointer<RecordValue>();
-    return record->get(Value(index).toString()).value;
+    return record->get(Value(index)).value;
   }
 
   void helper_index_store(uint64_t record_p, uint64_t index, uint64_t value) {
@@ -119,7 +100,7 @@ namespace ASM {
       cout << endl << "helper_index_store" << endl;
     #endif
     RecordValue* record = Value(record_p).getPointer<RecordValue>();
-    record->insert(Value(index).toString(), Value(value));
+    record->insert(Value(index), Value(value));
   }
 
   void helper_throw_not_int() {
@@ -135,10 +116,14 @@ namespace ASM {
   }
 
   void helper_throw_uninitialized(ClosureFunctionValue* closure, int index) {
-    std::string name = closure->value->names_[index];
+    std::string name = closure->value->names_[index].str();
     throw UninitializedVariableException(name);
   }
 
+  void helper_throw_uninitialized_global(int slot) {
+    throw UninitializedVariableException(interpreter->global_names[slot].str() + " has not been assigned yet, but it has been used");
+  }
+
   uint64_t helper_add(uint64_t left, uint64_t right) {
     #if DEBUG
       cout << endl << "helper_add" << endl;
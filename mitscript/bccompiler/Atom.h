@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+#include <ostream>
+#include <functional>
+#include <unordered_map>
+
+namespace BC {
+  // An interned name. Every distinct string has exactly one entry in the
+  // process-wide atom table, which also holds its hash, so atoms compare by
+  // pointer and hash without looking at their characters.
+  //
+  // Entries are never freed, so an Atom stays valid for the whole run.
+  class Atom {
+    typedef std::unordered_map<std::string, size_t> Table;
+    typedef Table::value_type Entry;
+
+    const Entry* entry;
+
+    explicit Atom(const Entry* entry) : entry(entry) {}
+
+    static Table& table() {
+      static Table* atoms = new Table();
+      return *atoms;
+    }
+
+  public:
+    Atom() : Atom(std::string()) {}
+
+    Atom(const std::string& name) {
+      Table& atoms = table();
+      auto it = atoms.find(name);
+      if (it == atoms.end()) {
+        it = atoms.emplace(name, std::hash<std::string>()(name)).first;
+      }
+      entry = &*it;
+    }
+
+    Atom(const char* name) : Atom(std::string(name)) {}
+
+    // The atom for name if it has been interned already. A name that was
+    // never interned can't be the key of anything, so lookups stop here.
+    static bool find(const std::string& name, Atom& atom) {
+      Table& atoms = table();
+      auto it = atoms.find(name);
+      if (it == atoms.end()) {
+        return false;
+      }
+      atom = Atom(&*it);
+      return true;
+    }
+
+    const std::string& str() const { return entry->first; }
+    size_t hash() const { return entry->second; }
+
+    operator const std::string&() const { return entry->first; }
+
+    bool operator==(const Atom& other) const { return entry == other.entry; }
+    bool operator!=(const Atom& other) const { return entry != other.entry; }
+  };
+
+  inline std::ostream& operator<<(std::ostream& os, const Atom& atom) {
+    return os << atom.str();
+  }
+}
+
+namespace std {
+  template<>
+  struct hash<BC::Atom> {
+    size_t operator()(const BC::Atom& atom) const { return atom.hash(); }
+  };
+}
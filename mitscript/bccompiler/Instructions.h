@@ -252,4 +252,20 @@ namespace BC {
     };
 
     typedef std::vector<Instruction> InstructionList;
+
+    // An instruction pre-decoded for the threaded interpreter: the address of
+    // the handler for its operation and its operand, with jump targets resolved
+    // to offsets in the decoded stream. Superinstructions, which stand for a
+    // sequence of instructions, use the extra operands; operation is only kept
+    // for --profile-opcodes.
+    struct ThreadedInstruction
+    {
+        const void* handler;
+        int32_t operand;
+        int32_t operand1;
+        int32_t operand2;
+        Operation operation;
+    };
+
+    typedef std::vector<ThreadedInstruction> ThreadedInstructionList;
 }
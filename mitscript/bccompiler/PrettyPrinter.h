@@ -115,7 +115,8 @@ namespace BC {
             return os;
         }
 
-        void print(const std::string &name, const std::vector<std::string> &names, std::ostream &os)
+        template<typename T>
+        void print(const std::string &name, const std::vector<T> &names, std::ostream &os)
         {
             print_indent(os) << name << " = [";
 
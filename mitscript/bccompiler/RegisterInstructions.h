@@ -0,0 +1,155 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace BC {
+    // Three-address form of a BC::Function, produced by VM::RegisterCompiler.
+    // Every operand names a slot in the frame's register file, which holds the
+    // function's local variables and, past the frame's reference and closure
+    // slots, the temporaries that replace the operand stack.
+    enum class RegisterOperation
+    {
+        // Description: copy one register into another
+        // Mnemonic:    move a b
+        // Registers:   r[a] = r[b]
+        Move,
+
+        // Description: load a constant into a register
+        // Operand b:   index of constant in enclosing function's list of constants
+        // Mnemonic:    load_const a b
+        // Registers:   r[a] = f.constants()[b]
+        LoadConst,
+
+        // Description: load a function into a register
+        // Operand b:   index of function in enclosing function's list of functions
+        // Mnemonic:    load_func a b
+        // Registers:   r[a] = f.functions()[b]
+        LoadFunc,
+
+        // Description: load value of global variable
+        // Operand b:   index of name of global variable in enclosing function's names list
+        // Mnemonic:    load_global a b
+        // Registers:   r[a] = global_value_of(f.names[b])
+        LoadGlobal,
+
+        // Description: store value into global variable
+        // Operand a:   index of name of global variable in enclosing function's names list
+        // Mnemonic:    store_global a b
+        // Registers:   global_value_of(f.names[a]) = r[b]
+        StoreGlobal,
+
+        // Description: load a reference to a local or free variable
+        // Operand b:   index of local variable reference
+        // Mnemonic:    push_ref a b
+        // Registers:   r[a] = address_of(refs[b])
+        PushReference,
+
+        // Description: load the value behind a reference
+        // Operand b:   index of local variable reference
+        // Mnemonic:    load_ref a b
+        // Registers:   r[a] = value_of(refs[b])
+        LoadReference,
+
+        // Description: store a value behind a reference
+        // Operand a:   index of local variable reference
+        // Mnemonic:    store_ref a b
+        // Registers:   value_of(refs[a]) = r[b]
+        StoreReference,
+
+        // Description: allocates a record
+        // Mnemonic:    alloc_record a
+        // Registers:   r[a] = record
+        AllocRecord,
+
+        // Description: load value of field from record
+        // Operand c:   index of the site's inline cache in the enclosing function's field_caches
+        // Mnemonic:    field_load a b c
+        // Registers:   r[a] = record_value_of(r[b], f.field_caches[c].name)
+        FieldLoad,
+
+        // Description: store value into field of record
+        // Operand b:   index of the site's inline cache in the enclosing function's field_caches
+        // Mnemonic:    field_store a b c
+        // Registers:   record_value_of(r[a], f.field_caches[b].name) = r[c]
+        FieldStore,
+
+        // Description: load value from index of record
+        // Mnemonic:    index_load a b c
+        // Registers:   r[a] = r[b][r[c]]
+        IndexLoad,
+
+        // Description: store value into index of record
+        // Mnemonic:    index_store a b c
+        // Registers:   r[a][r[b]] = r[c]
+        IndexStore,
+
+        // Description: allocate a closure
+        // Operand b:   the number of free variable references passed to the closure
+        // Mnemonic:    alloc_closure a b
+        // Registers:   r[a] = closure(r[a + b], [r[a + b - 1], ..., r[a]])
+        AllocClosure,
+
+        // Description: call a closure, arguments are passed in consecutive registers
+        // Operand b:   number of arguments
+        // Mnemonic:    call a b
+        // Registers:   r[a] = r[a + b](r[a], ..., r[a + b - 1])
+        Call,
+
+        // Description: ends the execution of the enclosing function
+        // Mnemonic:    return a
+        Return,
+
+        // Description: binary operations (as given in the semantics of Assignment #2)
+        // Mnemonic:    op a b c
+        // Registers:   r[a] = op(r[b], r[c])
+        Add,
+        Sub,
+        Mul,
+        Div,
+        Gt,
+        Geq,
+        Eq,
+        And,
+        Or,
+
+        // Description: unary operations
+        // Mnemonic:    op a b
+        // Registers:   r[a] = op(r[b])
+        Neg,
+        Not,
+
+        // Description: transfers execution to the instruction at offset a
+        // Mnemonic:    goto a
+        Goto,
+
+        // Description: transfers execution to the instruction at offset a if r[b] is true
+        // Mnemonic:    if a b
+        If,
+
+        GarbageCollect,
+        ThrowUninitialized,
+    };
+
+    struct RegisterInstruction
+    {
+        RegisterInstruction(const RegisterOperation operation, int32_t a = 0, int32_t b = 0, int32_t c = 0)
+        : operation(operation), a(a), b(b), c(c)
+        {
+
+        }
+
+        RegisterOperation operation;
+        int32_t a;
+        int32_t b;
+        int32_t c;
+
+        std::string toString() {
+            static std::string names[] = {"Move", "LoadConst", "LoadFunc", "LoadGlobal", "StoreGlobal", "PushReference", "LoadReference", "StoreReference", "AllocRecord", "FieldLoad", "FieldStore", "IndexLoad", "IndexStore", "AllocClosure", "Call", "Return", "Add", "Sub", "Mul", "Div", "Gt", "Geq", "Eq", "And", "Or", "Neg", "Not", "Goto", "If", "GarbageCollect", "ThrowUninitialized"};
+            return names[static_cast<int>(operation)] + " " + std::to_string(a) + " " + std::to_string(b) + " " + std::to_string(c);
+        };
+    };
+
+    typedef std::vector<RegisterInstruction> RegisterInstructionList;
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "Instructions.h"
+#include "RegisterInstructions.h"
+#include "Atom.h"
 
 #include <string>
 #include <stack>
@@ -8,10 +10,35 @@
 #include <memory>
 #include <cstdint>
 #include <map>
+#include <deque>
 
 #include "include/x64asm.h"
 
+// Number of receiver shapes remembered by each field access site
+#define FIELD_CACHE_SIZE 4
+// Set in FieldCache::slots for stores that add the field, which have to change the record's shape
+#define FIELD_CACHE_TRANSITION (1ULL << 32)
+
+namespace VM {
+  struct Shape;
+}
+
 namespace BC {
+  // Inline cache of one FieldLoad/FieldStore site: the last FIELD_CACHE_SIZE
+  // record shapes seen there and where the field lives in each of them.
+  // Compiled code reads shapes and slots directly, so their layout matters.
+  struct FieldCache {
+    VM::Shape* shapes[FIELD_CACHE_SIZE] = {};
+    // Slot of the field, or -1 if records of that shape lack it (loads only).
+    // Stores that add the field are marked with FIELD_CACHE_TRANSITION
+    int64_t slots[FIELD_CACHE_SIZE] = {};
+    VM::Shape* transitions[FIELD_CACHE_SIZE] = {};
+    size_t next = 0;
+    Atom name;
+
+    FieldCache(Atom name) : name(name) { }
+  };
+
   struct Constant {
     virtual ~Constant() {}
     virtual bool operator==(const Constant& other) {
@@ -85,7 +112,7 @@ namespace BC {
     std::vector<std::string> free_vars_;
 
     // List of global variable and field names used inside the function
-    std::vector<std::string> names_;
+    std::vector<Atom> names_;
 
     InstructionList instructions;
 
@@ -95,6 +122,25 @@ namespace BC {
     x64asm::Function compiled_function;
 
     std::map<size_t, size_t> labels;
+
+    // constants_ as tagged VM::Value words, filled in by VM::load_constants when the program is loaded
+    std::vector<uint64_t> constant_values;
+
+    // Index into names_ to the slot of that global in VM::Interpreter::globals,
+    // -1 for names that are only used as fields. Filled in when the program is loaded
+    std::vector<int32_t> global_slots;
+
+    // Inline caches for the field accesses of every compiled form of this function
+    std::deque<FieldCache> field_caches;
+
+    // Pre-decoded form of instructions for the stack interpreter, built on first call
+    ThreadedInstructionList threaded_instructions;
+    bool is_threaded = false;
+
+    // Register form of instructions, built on first call when running with OPTIMIZATION_REGISTER_VM
+    RegisterInstructionList register_instructions;
+    size_t register_count = 0;
+    bool is_register_compiled = false;
   };
 
   class FunctionLinkedList : public std::enable_shared_from_this<FunctionLinkedList> {
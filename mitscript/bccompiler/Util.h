@@ -6,11 +6,11 @@
 using namespace std;
 using namespace std::experimental;
 
-template<typename T>
-optional<size_t> index(vector<T> &v, T &x, bool insert = false);
+template<typename T, typename U>
+optional<size_t> index(vector<T> &v, const U &x, bool insert = false);
 
-template<typename T>
-size_t insert(vector<T> &v, T &x);
+template<typename T, typename U>
+size_t insert(vector<T> &v, const U &x);
 
 template<typename T>
 optional<size_t> index_by_val(vector<shared_ptr<T>> &v, shared_ptr<T> x, bool insert = false);
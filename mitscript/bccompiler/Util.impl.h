@@ -9,7 +9,7 @@ using namespace std::experimental;
 
 namespace Private {
   template<typename T>
-  optional<size_t> index(vector<T> &v, T &x, typename vector<T>::iterator pos, bool insert) {
+  optional<size_t> index(vector<T> &v, const T &x, typename vector<T>::iterator pos, bool insert) {
     if (pos != v.end()) {
       return distance(v.begin(), pos);
     } else if (insert) {
@@ -21,14 +21,16 @@ namespace Private {
   }
 }
 
-template<typename T>
-optional<size_t> index(vector<T> &v, T &x, bool insert) {
-  auto pos = find(v.begin(), v.end(), x);
-  return Private::index(v, x, pos, insert);
+// x is converted to the element type once, so that names can be looked up in lists of atoms
+template<typename T, typename U>
+optional<size_t> index(vector<T> &v, const U &x, bool insert) {
+  const T key(x);
+  auto pos = find(v.begin(), v.end(), key);
+  return Private::index(v, key, pos, insert);
 }
 
-template<typename T>
-size_t insert(vector<T> &v, T &x) {
+template<typename T, typename U>
+size_t insert(vector<T> &v, const U &x) {
   return index(v, x, true).value();
 }
 
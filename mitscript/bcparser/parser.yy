@@ -161,7 +161,7 @@ Function:
   T_instructions '=' '[' InstructionList ']'
   '}'
 {
-	$$ = new Function{*$6, *$12, safe_unsigned_cast($17), *$22, *$28, *$34, *$40, *$46};
+	$$ = new Function{*$6, *$12, safe_unsigned_cast($17), *$22, *$28, *$34, vector<Atom>($40->begin(), $40->end()), *$46};
 
     out = $$;
 }
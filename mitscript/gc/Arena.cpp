@@ -0,0 +1,407 @@
+#include "Arena.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace GC {
+  // How many empty standard pages to hold on to instead of freeing
+  static const size_t MAX_SPARE_PAGES = 16;
+
+  const int32_t Page::cards_offset = offsetof(Page, cards);
+
+  Page* Arena::acquire(size_t bytes) {
+    Page* page;
+    if (bytes == Page::BYTES && spare) {
+      page = spare;
+      spare = spare->next;
+      spare_count--;
+    } else {
+      void* memory;
+      if (posix_memalign(&memory, Page::BYTES, bytes) != 0) {
+        throw std::bad_alloc();
+      }
+      page = static_cast<Page*>(memory);
+    }
+    page->next = nullptr;
+    page->top = reinterpret_cast<char*>(page->cells());
+    page->end = reinterpret_cast<char*>(page) + bytes;
+    page->live = 0;
+    page->cell_bytes = 0;
+    page->large = false;
+    page->clean_cards();
+    return page;
+  }
+
+  void Arena::release(Page* page) {
+    if (page->end - reinterpret_cast<char*>(page) == static_cast<ptrdiff_t>(Page::BYTES) &&
+        spare_count < MAX_SPARE_PAGES) {
+      page->next = spare;
+      spare = page;
+      spare_count++;
+    } else {
+      std::free(page);
+    }
+  }
+
+  void Arena::release_all(Page* page) {
+    while (page) {
+      Page* next = page->next;
+      std::free(page);
+      page = next;
+    }
+  }
+
+  Arena::~Arena() {
+    if (sweeper.joinable()) {
+      {
+        std::lock_guard<std::mutex> guard(sweeper_lock);
+        sweeper_stopping = true;
+      }
+      sweeper_wake.notify_all();
+      sweeper.join();
+      // Pages it left behind
+      for (Page* page : sweep_queue) {
+        if (page) {
+          std::free(page);
+        }
+      }
+      release_all(swept.load());
+    }
+    release_all(nursery);
+    release_all(retired);
+    release_all(large);
+    for (size_t i = 0; i < CLASSES; i++) {
+      release_all(pages[i]);
+      release_all(unswept[i]);
+    }
+    release_all(unswept_retired);
+    release_all(unswept_large);
+    release_all(spare);
+  }
+
+  Cell* Arena::allocate_large(size_t bytes) {
+    Page* page = acquire(sizeof(Page) + bytes);
+    page->large = true;
+    page->next = large;
+    large = page;
+    return page->bump(bytes);
+  }
+
+  // Unswept pages of the class are swept for room before a new page is taken
+  Cell* Arena::allocate_class(size_t bytes) {
+    size_t index = class_index(bytes);
+    while (true) {
+      Cell* cell = free_cells[index];
+      if (cell) {
+        free_cells[index] = cell->next_free();
+        return cell;
+      }
+      Page* page = pages[index];
+      if (page && page->fits(bytes)) {
+        return page->bump(bytes);
+      }
+      if (unswept[index]) {
+        sweep_class_page(index);
+      } else if (!collect_swept()) {
+        break;
+      }
+    }
+    Page* page = acquire();
+    page->cell_bytes = bytes;
+    page->next = pages[index];
+    pages[index] = page;
+    return page->bump(bytes);
+  }
+
+  // Young objects of any size share the nursery, they only need to fit in a page
+  void* Arena::allocate_young(size_t object_bytes) {
+    size_t bytes = cell_bytes(object_bytes);
+    if (!nursery || !nursery->fits(bytes)) {
+      Page* page = acquire();
+      page->next = nursery;
+      nursery = page;
+      if (!page->fits(bytes)) {
+        throw std::bad_alloc();
+      }
+    }
+    Cell* cell = nursery->bump(bytes);
+    cell->bytes = bytes;
+    cell->state = Cell::FREE;
+    return cell->object();
+  }
+
+  void* Arena::allocate_old(size_t object_bytes) {
+    size_t bytes = cell_bytes(object_bytes);
+    Cell* cell = bytes > MAX_CLASS_BYTES ? allocate_large(bytes) : allocate_class(bytes);
+    cell->bytes = bytes;
+    cell->state = Cell::FREE;
+    return cell->object();
+  }
+
+  Collectable* Arena::copy(Collectable* object) {
+    size_t object_bytes = Cell::of(object)->bytes - sizeof(Cell);
+    void* to = allocate_old(object_bytes);
+    memcpy(to, static_cast<void*>(object), object_bytes);
+    commit(to);
+    Cell::of(object)->state = Cell::FORWARDED;
+    memcpy(static_cast<void*>(object), &to, sizeof(to));
+    return static_cast<Collectable*>(to);
+  }
+
+  void Arena::pin(const uintptr_t* begin, const uintptr_t* end, std::vector<Collectable*>& pinned) {
+    std::vector<uintptr_t> nursery_pages;
+    for (Page* page = nursery; page; page = page->next) {
+      nursery_pages.push_back(reinterpret_cast<uintptr_t>(page));
+    }
+    std::sort(nursery_pages.begin(), nursery_pages.end());
+
+    std::vector<uintptr_t> addresses;
+    for (const uintptr_t* word = begin; word != end; word++) {
+      uintptr_t page = *word & ~(Page::BYTES - 1);
+      if (std::binary_search(nursery_pages.begin(), nursery_pages.end(), page)) {
+        addresses.push_back(*word);
+      }
+    }
+    std::sort(addresses.begin(), addresses.end());
+
+    // Both the addresses and the cells of a page are in ascending order, so
+    // each page is walked at most once
+    auto address = addresses.begin();
+    while (address != addresses.end()) {
+      Page* page = reinterpret_cast<Page*>(*address & ~(Page::BYTES - 1));
+      uintptr_t page_end = reinterpret_cast<uintptr_t>(page) + Page::BYTES;
+      Cell* cell = page->cells();
+      while (address != addresses.end() && *address < page_end) {
+        while (cell != page->first_free() && reinterpret_cast<uintptr_t>(cell->next()) <= *address) {
+          cell = cell->next();
+        }
+        if (cell == page->first_free()) {
+          // Past the objects handed out so far
+          while (address != addresses.end() && *address < page_end) {
+            address++;
+          }
+          break;
+        }
+        if (*address >= reinterpret_cast<uintptr_t>(cell) && cell->state == Cell::LIVE) {
+          cell->state = Cell::PINNED;
+          pinned.push_back(cell->object());
+        }
+        address++;
+      }
+    }
+  }
+
+  void Arena::begin_sweep(uint32_t epoch, bool background) {
+    sweep_epoch = epoch;
+    if (background) {
+      std::unique_lock<std::mutex> guard(sweeper_lock);
+      // It can still be on its way out of the last round
+      sweeper_wake.wait(guard, [this] { return !sweeper_busy; });
+      sweep_queue.clear();
+      for (size_t i = 0; i < CLASSES; i++) {
+        for (Page* page = pages[i]; page; page = page->next) {
+          sweep_queue.push_back(page);
+        }
+        pages[i] = nullptr;
+        free_cells[i] = nullptr;
+      }
+      for (Page** list : {&retired, &large}) {
+        for (Page* page = *list; page; page = page->next) {
+          sweep_queue.push_back(page);
+        }
+        *list = nullptr;
+      }
+      unswept_count = sweep_queue.size();
+      sweep_count = sweep_queue.size();
+      sweep_claimed = 0;
+      sweep_done = 0;
+      sweep_round++;
+      if (!sweeper.joinable()) {
+        sweeper = std::thread(&Arena::run_sweeper, this);
+      }
+      guard.unlock();
+      sweeper_wake.notify_all();
+      return;
+    }
+
+    for (size_t i = 0; i < CLASSES; i++) {
+      unswept[i] = pages[i];
+      pages[i] = nullptr;
+      free_cells[i] = nullptr;
+      for (Page* page = unswept[i]; page; page = page->next) {
+        unswept_count++;
+      }
+    }
+    unswept_retired = retired;
+    retired = nullptr;
+    unswept_large = large;
+    large = nullptr;
+    for (Page* list : {unswept_retired, unswept_large}) {
+      for (Page* page = list; page; page = page->next) {
+        unswept_count++;
+      }
+    }
+  }
+
+  size_t Arena::sweep_page(Page* page) {
+    size_t live = 0;
+    page->free_head = nullptr;
+    page->free_tail = nullptr;
+    for (Cell* cell = page->cells(); cell != page->first_free(); cell = cell->next()) {
+      if (cell->state != Cell::FREE) {
+        if (cell->object()->marked.load(std::memory_order_relaxed) == sweep_epoch) {
+          live++;
+          continue;
+        }
+        if (on_sweep) {
+          on_sweep(cell->object());
+        }
+        destroy(cell);
+      }
+      if (page->cell_bytes) {
+        cell->next_free() = page->free_head;
+        page->free_head = cell;
+        if (!page->free_tail) {
+          page->free_tail = cell;
+        }
+      }
+    }
+    page->live = live;
+    return live;
+  }
+
+  void Arena::adopt(Page* page) {
+    unswept_count--;
+    if (!page->live) {
+      release(page);
+    } else if (page->cell_bytes) {
+      size_t index = class_index(page->cell_bytes);
+      if (pages[index]) {
+        // Behind the page being bumped into, which keeps its place
+        page->next = pages[index]->next;
+        pages[index]->next = page;
+      } else {
+        page->next = nullptr;
+        pages[index] = page;
+      }
+      if (page->free_head) {
+        page->free_tail->next_free() = free_cells[index];
+        free_cells[index] = page->free_head;
+      }
+    } else {
+      Page*& list = page->large ? large : retired;
+      page->next = list;
+      list = page;
+    }
+  }
+
+  void Arena::sweep_class_page(size_t index) {
+    Page* page = unswept[index];
+    unswept[index] = page->next;
+    sweep_page(page);
+    adopt(page);
+  }
+
+  void Arena::sweep_other_page(Page*& from) {
+    Page* page = from;
+    from = page->next;
+    sweep_page(page);
+    adopt(page);
+  }
+
+  void Arena::sweep_queued(size_t count) {
+    size_t index;
+    while ((index = sweep_claimed.fetch_add(1)) < count) {
+      if (sweeper_stopping) {
+        return;
+      }
+      Page* page = sweep_queue[index];
+      sweep_queue[index] = nullptr;
+      sweep_page(page);
+      page->next = swept.load(std::memory_order_relaxed);
+      while (!swept.compare_exchange_weak(page->next, page, std::memory_order_release, std::memory_order_relaxed)) {}
+      sweep_done.fetch_add(1, std::memory_order_release);
+    }
+  }
+
+  bool Arena::collect_swept() {
+    Page* page = swept.exchange(nullptr, std::memory_order_acquire);
+    if (!page) {
+      return false;
+    }
+    while (page) {
+      Page* next = page->next;
+      adopt(page);
+      page = next;
+    }
+    return true;
+  }
+
+  void Arena::run_sweeper() {
+    size_t seen = 0;
+    while (true) {
+      size_t count;
+      {
+        std::unique_lock<std::mutex> guard(sweeper_lock);
+        sweeper_busy = false;
+        sweeper_wake.notify_all();
+        sweeper_wake.wait(guard, [this, seen] { return sweeper_stopping || sweep_round != seen; });
+        if (sweeper_stopping) {
+          return;
+        }
+        seen = sweep_round;
+        count = sweep_count;
+        sweeper_busy = true;
+      }
+      sweep_queued(count);
+    }
+  }
+
+  void Arena::sweep_step() {
+    if (!sweep_queue.empty()) {
+      collect_swept();
+      return;
+    }
+    for (size_t n = 0; n < CLASSES; n++) {
+      size_t index = (sweep_cursor + n) % CLASSES;
+      if (unswept[index]) {
+        sweep_cursor = index;
+        sweep_class_page(index);
+        return;
+      }
+    }
+    if (unswept_retired) {
+      sweep_other_page(unswept_retired);
+    } else if (unswept_large) {
+      sweep_other_page(unswept_large);
+    }
+  }
+
+  void Arena::finish_background_sweep() {
+    if (sweep_queue.empty()) {
+      return;
+    }
+    sweep_queued(sweep_queue.size());
+    while (sweep_done.load(std::memory_order_acquire) < sweep_queue.size()) {
+      std::this_thread::yield();
+    }
+    collect_swept();
+    sweep_queue.clear();
+  }
+
+  void Arena::finish_sweep() {
+    finish_background_sweep();
+    for (size_t i = 0; i < CLASSES; i++) {
+      while (unswept[i]) {
+        sweep_class_page(i);
+      }
+    }
+    while (unswept_retired) {
+      sweep_other_page(unswept_retired);
+    }
+    while (unswept_large) {
+      sweep_other_page(unswept_large);
+    }
+  }
+}
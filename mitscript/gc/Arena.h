@@ -0,0 +1,380 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Collectable.h"
+
+namespace GC {
+  // Every object the heap hands out sits right behind one of these. It is 8
+  // bytes so objects keep the 8 byte alignment the value tags rely on.
+  struct Cell {
+    enum State : uint32_t {
+      FREE = 0,
+      LIVE,
+      // Possibly referred to from the native stack, so it can't move
+      PINNED,
+      // Copied out of the nursery, the object space holds the new address
+      FORWARDED,
+    };
+
+    // Including this header
+    uint32_t bytes;
+    State state;
+
+    static Cell* of(Collectable* object) { return reinterpret_cast<Cell*>(object) - 1; }
+    Collectable* object() { return reinterpret_cast<Collectable*>(this + 1); }
+    Cell* next() { return reinterpret_cast<Cell*>(reinterpret_cast<char*>(this) + bytes); }
+    // Free cells of a size class are chained through their object space
+    Cell*& next_free() { return *reinterpret_cast<Cell**>(this + 1); }
+  };
+
+  // A block of cells. Cells are handed out from the front by bumping top, so
+  // everything between cells() and top has been allocated at some point and
+  // walking the page finds every object in it.
+  //
+  // Every page is aligned to BYTES, so the page an object is on is found by
+  // masking its address. Pages of large objects can be bigger, but their
+  // object still starts within the first BYTES.
+  struct Page {
+    static const size_t BYTES = 1 << 16;
+    // The card table splits a page into cards of 1 << CARD_SHIFT bytes. The
+    // write barrier dirties the card an old object starts on when a pointer
+    // to a young object may have been stored into it.
+    static const size_t CARD_SHIFT = 9;
+    static const size_t CARDS = BYTES >> CARD_SHIFT;
+    // Used by compiled code to mark cards
+    static const int32_t cards_offset;
+
+    Page* next;
+    char* top;
+    char* end;
+    // Cells in use, as counted by the last sweep
+    size_t live;
+    // The size of every cell for size class pages, 0 if cells vary
+    size_t cell_bytes;
+    // Holds a single object bigger than the largest size class
+    bool large;
+    // The free cells a sweep found on a size class page, chained
+    Cell* free_head;
+    Cell* free_tail;
+    uint8_t cards[CARDS];
+
+    Cell* cells() { return reinterpret_cast<Cell*>(this + 1); }
+    Cell* first_free() { return reinterpret_cast<Cell*>(top); }
+    bool fits(size_t bytes) { return static_cast<size_t>(end - top) >= bytes; }
+
+    Cell* bump(size_t bytes) {
+      Cell* cell = reinterpret_cast<Cell*>(top);
+      top += bytes;
+      return cell;
+    }
+
+    static Page* of(const void* address) {
+      return reinterpret_cast<Page*>(reinterpret_cast<uintptr_t>(address) & ~(BYTES - 1));
+    }
+
+    static void mark_card(const void* object) {
+      uintptr_t offset = reinterpret_cast<uintptr_t>(object) & (BYTES - 1);
+      of(object)->cards[offset >> CARD_SHIFT] = 1;
+    }
+
+    // Passes every object starting on a dirty card to visit and cleans the cards
+    template<typename VISIT>
+    void scan_dirty_cards(VISIT visit) {
+      const uint64_t* words = reinterpret_cast<const uint64_t*>(cards);
+      bool dirty = false;
+      for (size_t i = 0; i < CARDS / sizeof(uint64_t); i++) {
+        if (words[i]) {
+          dirty = true;
+          break;
+        }
+      }
+      if (!dirty) {
+        return;
+      }
+      uintptr_t base = reinterpret_cast<uintptr_t>(this);
+      uintptr_t first = reinterpret_cast<uintptr_t>(cells());
+      uintptr_t limit = reinterpret_cast<uintptr_t>(top);
+      if (cell_bytes) {
+        // Cells are evenly spaced, so the ones on a card are found directly
+        for (size_t card = 0; card < CARDS; card++) {
+          if (!cards[card]) {
+            continue;
+          }
+          cards[card] = 0;
+          uintptr_t card_start = base + (card << CARD_SHIFT);
+          uintptr_t card_end = card_start + (1 << CARD_SHIFT);
+          // Objects sit right after their cell's header
+          uintptr_t index = card_start <= first + sizeof(Cell) ? 0 :
+            (card_start - first - sizeof(Cell) + cell_bytes - 1) / cell_bytes;
+          for (uintptr_t cell = first + index * cell_bytes; cell < limit && cell + sizeof(Cell) < card_end; cell += cell_bytes) {
+            Cell* c = reinterpret_cast<Cell*>(cell);
+            if (c->state != Cell::FREE) {
+              visit(c->object());
+            }
+          }
+        }
+      } else {
+        for (Cell* cell = cells(); cell != first_free(); cell = cell->next()) {
+          uintptr_t offset = reinterpret_cast<uintptr_t>(cell->object()) - base;
+          if (offset < BYTES && cards[offset >> CARD_SHIFT] && cell->state != Cell::FREE) {
+            visit(cell->object());
+          }
+        }
+        clean_cards();
+      }
+    }
+
+    void clean_cards() {
+      memset(cards, 0, sizeof(cards));
+    }
+  };
+
+  /*
+  The memory behind the collected heap.
+
+  Young objects are bumped into nursery pages regardless of their size. Old
+  objects, and every object when the heap isn't generational, go to pages
+  holding a single size class, where dead cells are put on a free list by the
+  sweep. Objects bigger than the largest class get a page to themselves.
+
+  Minor collections copy surviving young objects into the old generation.
+  Nursery pages that still hold objects after a sweep, because they were
+  pinned or survived a full collection in place, are retired into the old
+  generation as they are and released once they empty out.
+
+  The old generation is swept lazily. A full collection only marks, then
+  hands every old page to begin_sweep, and a page is swept when allocation
+  of its size class runs out of room or when the heap spends some sweep
+  budget. Objects allocated since never land on an unswept page, so an
+  object there is dead exactly when it wasn't marked by that collection.
+
+  A background sweep instead queues every old page for a sweeper thread,
+  which the allocator only ever talks to through atomics: both claim pages
+  off the queue with a counter, and swept pages come back on a lock-free
+  stack the allocator takes whole when it runs out of room. Pages leave
+  the queue only by being swept, so the next collection finishes the sweep
+  before it looks at the old generation.
+  */
+  class Arena {
+  public:
+    static const size_t CLASS_STEP = 8;
+    static const size_t MAX_CLASS_BYTES = 512;
+    static const size_t CLASSES = MAX_CLASS_BYTES / CLASS_STEP;
+
+  private:
+    // Young pages, the one being bumped into first
+    Page* nursery = nullptr;
+    // Nursery pages with survivors in them
+    Page* retired = nullptr;
+    Page* large = nullptr;
+    Page* pages[CLASSES] = {};
+    Cell* free_cells[CLASSES] = {};
+    // Emptied standard sized pages kept around for reuse
+    Page* spare = nullptr;
+    size_t spare_count = 0;
+
+    // Old pages marked by the last full collection but not swept yet
+    Page* unswept[CLASSES] = {};
+    Page* unswept_retired = nullptr;
+    Page* unswept_large = nullptr;
+    size_t unswept_count = 0;
+    // Objects marked with anything else are dead
+    uint32_t sweep_epoch = 0;
+    // Where sweep_step looks for a size class with unswept pages first
+    size_t sweep_cursor = 0;
+
+    // Old pages queued for the background sweep, with how many have been
+    // claimed for sweeping and how many of those are done
+    std::vector<Page*> sweep_queue;
+    // The queue's length, for the sweeper thread to read under sweeper_lock
+    size_t sweep_count = 0;
+    std::atomic<size_t> sweep_claimed{0};
+    std::atomic<size_t> sweep_done{0};
+    // Swept by the sweeper thread and not yet taken by the allocator,
+    // chained through next
+    std::atomic<Page*> swept{nullptr};
+
+    // Started by the first background sweep. Guarded by sweeper_lock, it
+    // sleeps until sweep_round moves on and is busy while it sweeps.
+    std::thread sweeper;
+    std::mutex sweeper_lock;
+    std::condition_variable sweeper_wake;
+    size_t sweep_round = 0;
+    bool sweeper_busy = false;
+    std::atomic<bool> sweeper_stopping{false};
+
+    static size_t cell_bytes(size_t object_bytes) {
+      return (sizeof(Cell) + object_bytes + CLASS_STEP - 1) & ~(CLASS_STEP - 1);
+    }
+
+    static size_t class_index(size_t bytes) {
+      return bytes / CLASS_STEP - 1;
+    }
+
+    Page* acquire(size_t bytes = Page::BYTES);
+    void release(Page* page);
+    Cell* allocate_large(size_t bytes);
+    Cell* allocate_class(size_t bytes);
+
+    static void destroy(Cell* cell) {
+      cell->object()->~Collectable();
+      cell->state = Cell::FREE;
+    }
+
+    static void release_all(Page* page);
+
+    // Destroys the dead objects on an unswept page and returns how many are
+    // left. The free cells of a size class page are chained on the page.
+    size_t sweep_page(Page* page);
+    // Puts a swept page back where the allocator can use it
+    void adopt(Page* page);
+    void sweep_class_page(size_t index);
+    void sweep_other_page(Page*& from);
+
+    // Sweeps queued pages until none of the first count are left to claim,
+    // handing them over on swept
+    void sweep_queued(size_t count);
+    // Adopts everything on swept, returning whether there was anything
+    bool collect_swept();
+    void run_sweeper();
+
+  public:
+    // Called with each dead object a sweep finds, before it is destroyed
+    std::function<void(Collectable*)> on_sweep;
+
+    Arena() {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    // Frees the pages without running the destructors of what is left in them
+    ~Arena();
+
+    // Space for a new object of the given size; the caller constructs it and
+    // then calls commit
+    void* allocate_young(size_t object_bytes);
+    void* allocate_old(size_t object_bytes);
+
+    static void commit(void* memory) {
+      (reinterpret_cast<Cell*>(memory) - 1)->state = Cell::LIVE;
+    }
+
+    // Marks the young objects that contain any of the words in [begin, end),
+    // read as addresses, as pinned and adds them to pinned. Words that don't
+    // point into the nursery are ignored.
+    void pin(const uintptr_t* begin, const uintptr_t* end, std::vector<Collectable*>& pinned);
+
+    // The copy of a young object in the old generation, or nullptr if it
+    // hasn't been copied
+    static Collectable* forwarded(Collectable* object) {
+      Cell* cell = Cell::of(object);
+      return cell->state == Cell::FORWARDED ? *reinterpret_cast<Collectable**>(object) : nullptr;
+    }
+
+    // Moves a young object into the old generation, leaving its new address
+    // behind. The copy takes over the object's resources, so the original is
+    // never destroyed.
+    Collectable* copy(Collectable* object);
+
+    // Passes every old object starting on a dirty card to visit and cleans
+    // the cards
+    template<typename VISIT>
+    void scan_dirty_cards(VISIT visit) {
+      // Dead objects on unswept pages may point at memory that is gone
+      uint32_t epoch = sweep_epoch;
+      auto visit_marked = [&visit, epoch](Collectable* object) {
+        if (object->marked == epoch) {
+          visit(object);
+        }
+      };
+      for (size_t i = 0; i < CLASSES; i++) {
+        for (Page* page = pages[i]; page; page = page->next) {
+          page->scan_dirty_cards(visit);
+        }
+        for (Page* page = unswept[i]; page; page = page->next) {
+          page->scan_dirty_cards(visit_marked);
+        }
+      }
+      for (Page* list : {retired, large}) {
+        for (Page* page = list; page; page = page->next) {
+          page->scan_dirty_cards(visit);
+        }
+      }
+      for (Page* list : {unswept_retired, unswept_large}) {
+        for (Page* page = list; page; page = page->next) {
+          page->scan_dirty_cards(visit_marked);
+        }
+      }
+    }
+
+    // After a full collection nothing is young, so no card needs scanning
+    void clean_cards() {
+      for (size_t i = 0; i < CLASSES; i++) {
+        for (Page* list : {pages[i], unswept[i]}) {
+          for (Page* page = list; page; page = page->next) {
+            page->clean_cards();
+          }
+        }
+      }
+      for (Page* list : {retired, large, unswept_retired, unswept_large}) {
+        for (Page* page = list; page; page = page->next) {
+          page->clean_cards();
+        }
+      }
+    }
+
+    // Runs keep on every young object that wasn't copied out and destroys
+    // the ones it returns false for. The nursery is empty afterwards.
+    template<typename KEEP>
+    void sweep_young(KEEP keep) {
+      Page* page = nursery;
+      while (page) {
+        Page* next = page->next;
+        size_t live = 0;
+        for (Cell* cell = page->cells(); cell != page->first_free(); cell = cell->next()) {
+          if (cell->state == Cell::FREE) {
+            continue;
+          } else if (cell->state == Cell::FORWARDED) {
+            cell->state = Cell::FREE;
+          } else if (keep(cell->object())) {
+            cell->state = Cell::LIVE;
+            live++;
+          } else {
+            destroy(cell);
+          }
+        }
+        if (live) {
+          page->live = live;
+          page->next = retired;
+          retired = page;
+        } else {
+          release(page);
+        }
+        page = next;
+      }
+      nursery = nullptr;
+    }
+
+    // Starts sweeping the old generation after a full collection marked
+    // everything live with epoch. Sweeping must have finished. A background
+    // sweep is handed to the sweeper thread, so on_sweep may be called from
+    // it until finish_background_sweep.
+    void begin_sweep(uint32_t epoch, bool background);
+
+    bool sweep_pending() const {
+      return unswept_count > 0;
+    }
+
+    // Sweeps one unswept page, or takes what the sweeper thread has swept
+    void sweep_step();
+    void finish_sweep();
+    // Sweeps whatever the sweeper thread hasn't got to yet and waits for it.
+    // Old pages it is sweeping aren't on any list in the meantime.
+    void finish_background_sweep();
+  };
+}
@@ -1,4 +1,5 @@
 #pragma once
+#include <atomic>
 #include <cstdio>
 #include <cstdint>
 #include "CollectedHeap.fwd.h"
@@ -7,18 +8,24 @@ namespace GC {
   //Any object that inherits from collectable can be created and tracked by the garbage collector.
   class Collectable {
   public:
-    Collectable(CollectedHeap& heap) : heap(heap) {}
+    Collectable(CollectedHeap& heap, uint8_t kind = 0) : kind(kind), heap(heap) {}
     virtual ~Collectable() {}
 
-    void mark(uint32_t generation, bool mark_recent_only);
-    void forceMark(uint32_t generation, bool mark_recent_only);
     virtual size_t size() = 0;
 
+    // What sort of object this is, so subclasses can check types without RTTI
+    const uint8_t kind;
     bool is_old = false;
-    uint32_t marked = 0;
+    // The generation of the last full collection that reached this object.
+    // Atomic so parallel marking threads can claim objects
+    std::atomic<uint32_t> marked{0};
 
   private:
-    virtual void markChildren(uint32_t generation, bool mark_recent_only) = 0;
+    // Passes every collectable this object points to to heap.mark
+    virtual void markChildren() = 0;
+    // Passes every reference to another collectable to heap.evacuate, for
+    // minor collections that move young objects
+    virtual void evacuateChildren() = 0;
   protected:
     /*
     The mark phase of the garbage collector needs to follow all pointers from the collectable objects, check
@@ -30,5 +37,6 @@ namespace GC {
 
     CollectedHeap& heap;
     friend CollectedHeap;
+    friend class ParallelMarker;
   };
 }
@@ -1,11 +1,14 @@
 #pragma once
 #include <list>
+#include <new>
 #include <cstdio>
 #include <vector>
 #include <iostream>
 #include <memory>
 #include <algorithm>
 #include "Collectable.h"
+#include "Arena.h"
+#include "ParallelMarker.h"
 #include "../options.h"
 
 #define OVERHEAD_FACTOR 5
@@ -21,33 +24,129 @@ namespace GC {
     -
   */
   class CollectedHeap {
-    list<Collectable*> recently_allocated_objects;
-    list<Collectable*> old_objects;
+    Arena arena;
 
   private:
+    // Allocations between steps of a lazy sweep
+    static const size_t SWEEP_INTERVAL = 32;
+    size_t sweep_countdown = SWEEP_INTERVAL;
+
+    // New objects start out young when the heap is generational. While the
+    // old generation has unswept pages, every few allocations sweep one, or
+    // take back what the sweeper thread has swept, so the sweep is done long
+    // before the next collection is due.
+    template<typename T>
+    void* reserve() {
+      if (arena.sweep_pending() && --sweep_countdown == 0) {
+        sweep_countdown = SWEEP_INTERVAL;
+        arena.sweep_step();
+      }
+      if (has_optimization(OPTIMIZATION_GC_GENERATIONAL)) {
+        return arena.allocate_young(sizeof(T));
+      } else {
+        return arena.allocate_old(sizeof(T));
+      }
+    }
+
     template<typename T>
     void register_allocation(T* t) {
       if (has_option(OPTION_SHOW_MEMORY_TRACE)) {
         cout << "A," << (void*) t << endl;
       }
-      if (has_optimization(OPTIMIZATION_GC_GENERATIONAL)) {
-        recently_allocated_objects.push_back(t);
-      } else {
-        old_objects.push_back(t);
+      Arena::commit(t);
+      // The cell header in front of the object
+      increaseSize(sizeof(Cell));
+    }
+
+    // Objects reached by a full collection, checked and marked as they are
+    // taken off. Kept between collections so it only grows once
+    vector<Collectable*> mark_stack;
+
+    // How many objects popped off the mark stack are held back after being
+    // prefetched, so their headers are in cache by the time they are looked at
+    static const size_t PREFETCH_DISTANCE = 8;
+
+    // Returns the accounted size of what it marked
+    size_t drain_mark_stack() {
+      size_t marked_bytes = 0;
+      Collectable* window[PREFETCH_DISTANCE];
+      size_t first = 0;
+      size_t count = 0;
+      while (true) {
+        while (count < PREFETCH_DISTANCE && !mark_stack.empty()) {
+          Collectable* object = mark_stack.back();
+          mark_stack.pop_back();
+          __builtin_prefetch(object, 1);
+          window[(first + count) % PREFETCH_DISTANCE] = object;
+          count++;
+        }
+        if (count == 0) {
+          return marked_bytes;
+        }
+        Collectable* object = window[first];
+        first = (first + 1) % PREFETCH_DISTANCE;
+        count--;
+        if (object->marked == generation) {
+          continue;
+        }
+        object->marked.store(generation, std::memory_order_relaxed);
+        marked_bytes += object->size() + sizeof(Cell);
+        object->markChildren();
+      }
+    }
+
+    // Started by the first full collection when it is to use more than one thread
+    unique_ptr<ParallelMarker> parallel_marker;
+
+    // The part of bytes_current not held by objects the last full collection
+    // found alive: dead objects it left unswept, and whatever the size
+    // accounting has drifted by. Sweeping takes the dead objects' share off.
+    // Signed, since sizes can change after an object is marked
+    std::atomic<int64_t> unswept_bytes{0};
+
+    // Objects copied or pinned by a minor collection whose children still
+    // need to be evacuated
+    vector<Collectable*> grey_objects;
+
+    // Pins every young object a word on the native stack, or a callee-saved
+    // register, might point into. Interpreted and compiled frames keep
+    // pointers there that aren't roots the collector can update.
+    __attribute__((noinline)) void pin_native_stack() {
+      if (!native_stack_base) {
+        return;
+      }
+      __builtin_unwind_init();
+      volatile uintptr_t marker = 0;
+      const uintptr_t* begin = const_cast<const uintptr_t*>(&marker);
+      const uintptr_t* end = static_cast<const uintptr_t*>(native_stack_base);
+      size_t first_pinned = grey_objects.size();
+      arena.pin(begin, end, grey_objects);
+      for (size_t i = first_pinned; i < grey_objects.size(); i++) {
+        grey_objects[i]->is_old = true;
+      }
+    }
+
+    void trace_deallocation(Collectable* object) {
+      #ifdef DEBUG
+        cout << "ABOUT TO COLLECT: ";
+      #endif
+      if (has_option(OPTION_SHOW_MEMORY_TRACE)) {
+        cout << "D," << (void*) object << endl;
       }
-      increaseSize(sizeof(Collectable*));
     }
 
   public:
     size_t generation = 0;
     size_t max_bytes_used = 0;
     size_t bytes_max;
-    size_t bytes_current = 0;
+    // Also lowered by the sweeper thread during a background sweep
+    std::atomic<size_t> bytes_current{0};
     size_t full_collections = 0;
     size_t fast_collections = 0;
     size_t successful_full_collections = 0;
     size_t successful_fast_collections = 0;
-    list<uintptr_t*> cross_generation_pointers;
+    // Native frames of the running program are all below this address
+    void* native_stack_base = nullptr;
 
     /*
     The constructor should take as an argument the maximum size of the garbage collected heap.
@@ -58,21 +157,26 @@ namespace GC {
     */
     CollectedHeap(size_t maxmem) : bytes_max(maxmem) {
       increaseSize(sizeof(CollectedHeap));
+      arena.on_sweep = [this](Collectable* object) {
+        unswept_bytes.fetch_sub((object->size() + sizeof(Cell)) * OVERHEAD_FACTOR, std::memory_order_relaxed);
+        trace_deallocation(object);
+        decreaseSize(sizeof(Cell));
+      };
     }
 
     void increaseSize(size_t n) {
       #if DEBUG
         cout << "increasing stack by " << n << endl;
       #endif
-      bytes_current += n * OVERHEAD_FACTOR;
-      max_bytes_used = max(max_bytes_used, bytes_current);
+      size_t bytes = bytes_current.fetch_add(n * OVERHEAD_FACTOR, std::memory_order_relaxed) + n * OVERHEAD_FACTOR;
+      max_bytes_used = max(max_bytes_used, bytes);
     }
 
     void decreaseSize(size_t n) {
       #if DEBUG
         cout << "decreasing stack by " << n << endl;
       #endif
-      bytes_current -= n * OVERHEAD_FACTOR;
+      bytes_current.fetch_sub(n * OVERHEAD_FACTOR, std::memory_order_relaxed);
     }
 
     /*
@@ -88,7 +192,7 @@ namespace GC {
     */
     template<typename T>
     T* allocate() {
-      auto t = new T(*this);
+      auto t = new (reserve<T>()) T(*this);
       register_allocation(t);
       return t;
     }
@@ -99,100 +203,217 @@ namespace GC {
     */
     template<typename T, typename ARG>
     T* allocate(ARG a) {
-      auto t = new T(*this, a);
+      auto t = new (reserve<T>()) T(*this, a);
       register_allocation(t);
       return t;
     }
 
     template<typename T, typename ARG, typename ARG2>
     T* allocate(ARG a, ARG2 b) {
-      auto t = new T(*this, a, b);
+      auto t = new (reserve<T>()) T(*this, a, b);
       register_allocation(t);
       return t;
     }
 
+    // Reached from a marked object or a root during a full collection.
+    // Marking is iterative, so deep object graphs don't use up the C++ stack
+    void mark(Collectable* object) {
+      vector<Collectable*>* stack = ParallelMarker::local_stack();
+      if (stack) {
+        stack->push_back(object);
+      } else {
+        mark_stack.push_back(object);
+      }
+    }
+
+    // The write barrier, for when a pointer to a young object may have been
+    // stored into an old one
+    static void remember(Collectable* object) {
+      Page::mark_card(object);
+    }
+
     /*
-    The gc method should be called by your VM (or by other methods in CollectedHeap)
-    whenever the VM decides it is time to reclaim memory. This method
-    triggers the mark and sweep process.
+    Moves the young object a reference points to into the old generation
+    during a minor collection and returns where it lives now. Old and pinned
+    objects stay where they are.
+    */
+    Collectable* evacuate_object(Collectable* object) {
+      if (object->is_old) {
+        return object;
+      }
+      Collectable* copy = Arena::forwarded(object);
+      if (copy) {
+        return copy;
+      }
+      copy = arena.copy(object);
+      copy->is_old = true;
+      if (has_option(OPTION_SHOW_MEMORY_TRACE)) {
+        cout << "D," << (void*) object << endl;
+        cout << "A," << (void*) copy << endl;
+      }
+      grey_objects.push_back(copy);
+      return copy;
+    }
+
+    // Whether a value word holds a pointer: tags 4 and 7, not the small string tag 6
+    static bool is_pointer(uint64_t word) {
+      return (0x90 >> (word & 0x7)) & 1;
+    }
 
-    The ITERATOR type should support comparison, assignment and the ++ operator.
-    I should also be able to dereference an interator to get a Collectable object.
-    This code will take iterators marking the [begin, end) range of the rootset
+    // Updates a slot holding a value, if it is a pointer
+    void evacuate(uint64_t& word) {
+      if (is_pointer(word)) {
+        uint64_t tag = word & 0x7;
+        word = reinterpret_cast<uint64_t>(evacuate_object(reinterpret_cast<Collectable*>(word & ~0x7))) | tag;
+      }
+    }
+
+    // Updates a slot holding a plain pointer to a collectable
+    template<typename T>
+    void evacuate(T*& pointer) {
+      pointer = static_cast<T*>(evacuate_object(pointer));
+    }
+
+    // Whether the last full collection left pages to be swept
+    bool sweep_pending() const {
+      return arena.sweep_pending();
+    }
 
+    // Sweeps what is left, releasing the memory of everything found dead
+    void finish_sweep() {
+      arena.finish_sweep();
+    }
+
+    // The size of what the last full collection found alive plus what has
+    // been allocated since, which is what bytes_current would be had the
+    // collection swept everything right away. Collections are triggered on
+    // this, so sweeping lazily doesn't put them off.
+    size_t surviving_bytes() const {
+      size_t current = bytes_current;
+      int64_t unswept = unswept_bytes.load(std::memory_order_relaxed);
+      if (unswept <= 0) {
+        return current;
+      }
+      return current - min(current, static_cast<size_t>(unswept));
+    }
+
+    /*
+    Root visitors. A collection calls its roots callback with one of these,
+    which the VM calls in turn with every root slot in place: value words
+    and plain pointers to collectables.
     */
-    template<typename ITERATOR>
-    void gcFast(ITERATOR begin, ITERATOR end) {
+    struct Evacuator {
+      CollectedHeap& heap;
+
+      void operator()(uint64_t& word) { heap.evacuate(word); }
+      template<typename T>
+      void operator()(T*& pointer) { heap.evacuate(pointer); }
+    };
+
+    struct Marker {
+      CollectedHeap& heap;
+
+      void operator()(uint64_t& word) {
+        if (is_pointer(word)) {
+          heap.mark(reinterpret_cast<Collectable*>(word & ~0x7));
+        }
+      }
+      template<typename T>
+      void operator()(T*& pointer) { heap.mark(pointer); }
+    };
+
+    /*
+    A minor collection copies the young objects that are still reachable
+    into the old generation, so it costs time in proportion to what survives
+    rather than to what was allocated. roots is called with an Evacuator,
+    which updates each root slot to the moved object. Old objects are
+    only looked at when they are on a card dirtied by the write barrier.
+
+    Anything the native stack might refer to is pinned first and promoted in
+    place instead.
+    */
+    template<typename ROOTS>
+    void gcFast(ROOTS roots) {
       fast_collections++;
       generation++;
+      // Old pages being swept in the background can't have their cards scanned
+      arena.finish_background_sweep();
 
-      for (auto c = begin; c != end; c++) {
-        (*c)->mark(generation, true);
-      }
+      pin_native_stack();
+      Evacuator visit{*this};
+      roots(visit);
 
-      for (auto pointer : cross_generation_pointers) {
-        if (((*pointer) & 0x4) == 0x4) {
-          ((GC::Collectable*) ((*pointer) & ~0x7))->mark(generation, true);
-        }
+      arena.scan_dirty_cards([](Collectable* object) {
+        object->evacuateChildren();
+      });
+
+      while (!grey_objects.empty()) {
+        Collectable* object = grey_objects.back();
+        grey_objects.pop_back();
+        object->evacuateChildren();
       }
 
-      cross_generation_pointers.clear();
-
-      auto it = recently_allocated_objects.begin();
-      auto it_end = recently_allocated_objects.end();
-      while (it != it_end) {
-        auto ptr = *it;
-        ptr->is_old = true;
-        if (ptr->marked != generation) {
-          #ifdef DEBUG
-            cout << "ABOUT TO COLLECT: ";
-          #endif
-          if (has_option(OPTION_SHOW_MEMORY_TRACE)) {
-            cout << "D," << (void*) ptr << endl;
-          }
-          delete ptr;
-          it = recently_allocated_objects.erase(it);
-        } else {
-          it++;
+      arena.sweep_young([this](Collectable* object) {
+        if (object->is_old) {
+          return true;
         }
-      }
-      old_objects.splice(old_objects.end(), recently_allocated_objects);
+        trace_deallocation(object);
+        return false;
+      });
     }
 
+    /*
+    The gc method should be called by your VM (or by other methods in CollectedHeap)
+    whenever the VM decides it is time to reclaim memory. This method
+    triggers the mark and sweep process.
 
-    template<typename ITERATOR>
-    void gcFull(ITERATOR begin, ITERATOR end) {
+    roots is called with a Marker to pass it every root slot. With
+    --gc-threads above 1 the roots are shared out among that many marking
+    threads. Only the
+    nursery is swept here; old pages are swept lazily afterwards, as
+    allocation needs them, or by the sweeper thread with
+    --opt=gc-background-sweep.
+    */
+    template<typename ROOTS>
+    void gcFull(ROOTS roots) {
       full_collections++;
+      arena.finish_sweep();
       generation++;
 
       if (has_optimization(OPTIMIZATION_GC_GENERATIONAL)) {
-        cross_generation_pointers.clear();
-        old_objects.splice(old_objects.end(), recently_allocated_objects);
-      }
-
-      for (auto c = begin; c != end; c++) {
-        (*c)->mark(generation, false);
-      }
-
-      auto it = old_objects.begin();
-      auto it_end = old_objects.end();
-      while (it != it_end) {
-        auto ptr = *it;
-        ptr->is_old = true;
-        if (ptr->marked != generation) {
-          #ifdef DEBUG
-            cout << "ABOUT TO COLLECT: ";
-          #endif
-          if (has_option(OPTION_SHOW_MEMORY_TRACE)) {
-            cout << "D," << (void*) ptr << endl;
-          }
-          delete ptr;
-          it = old_objects.erase(it);
-          decreaseSize(sizeof(Collectable*));
-        } else {
-          it++;
+        arena.clean_cards();
+      }
+
+      Marker visit{*this};
+      roots(visit);
+      size_t marked_bytes;
+      if (gc_threads() > 1) {
+        if (!parallel_marker) {
+          parallel_marker.reset(new ParallelMarker(gc_threads()));
         }
+        marked_bytes = parallel_marker->mark(mark_stack, generation);
+      } else {
+        marked_bytes = drain_mark_stack();
       }
+
+      auto keep = [this](Collectable* object) {
+        object->is_old = true;
+        if (object->marked == generation) {
+          return true;
+        }
+        trace_deallocation(object);
+        decreaseSize(sizeof(Cell));
+        return false;
+      };
+      // The memory trace is printed in order from this thread
+      bool background = has_optimization(OPTIMIZATION_GC_BACKGROUND_SWEEP) && !has_option(OPTION_SHOW_MEMORY_TRACE);
+      arena.begin_sweep(generation, background);
+      arena.sweep_young(keep);
+
+      // Whatever isn't accounted to marked objects is unswept garbage or drift
+      size_t live = (marked_bytes + sizeof(CollectedHeap)) * OVERHEAD_FACTOR;
+      size_t current = bytes_current;
+      unswept_bytes = current > live ? current - live : 0;
     }
   };
 }
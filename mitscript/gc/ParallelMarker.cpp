@@ -0,0 +1,149 @@
+#include "ParallelMarker.h"
+#include "Arena.h"
+
+namespace GC {
+  // How deep a thread's stack gets before it shares half of it
+  static const size_t SHARE_DEPTH = 32;
+
+  ParallelMarker::ParallelMarker(size_t thread_count) {
+    for (size_t i = 0; i < thread_count; i++) {
+      workers.emplace_back(new Worker());
+      workers.back()->id = i;
+    }
+    for (size_t i = 1; i < thread_count; i++) {
+      threads.emplace_back(&ParallelMarker::help, this, i);
+    }
+  }
+
+  ParallelMarker::~ParallelMarker() {
+    {
+      std::lock_guard<std::mutex> guard(control);
+      stopping = true;
+    }
+    start.notify_all();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
+  size_t ParallelMarker::mark(std::vector<Collectable*>& roots, uint32_t epoch) {
+    this->epoch = epoch;
+    for (auto& worker : workers) {
+      worker->marked_bytes = 0;
+    }
+    for (size_t i = 0; i < roots.size(); i++) {
+      workers[i % workers.size()]->stack.push_back(roots[i]);
+    }
+    roots.clear();
+    idle.store(0);
+
+    {
+      std::lock_guard<std::mutex> guard(control);
+      round++;
+      running = threads.size();
+    }
+    start.notify_all();
+
+    work(*workers[0]);
+
+    std::unique_lock<std::mutex> guard(control);
+    finished.wait(guard, [this] { return running == 0; });
+    size_t marked_bytes = 0;
+    for (auto& worker : workers) {
+      marked_bytes += worker->marked_bytes;
+    }
+    return marked_bytes;
+  }
+
+  // The loop of every thread but the one collecting, which marks once a round
+  void ParallelMarker::help(size_t id) {
+    size_t seen = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> guard(control);
+        start.wait(guard, [this, seen] { return stopping || round != seen; });
+        if (stopping) {
+          return;
+        }
+        seen = round;
+      }
+      work(*workers[id]);
+      {
+        std::lock_guard<std::mutex> guard(control);
+        running--;
+      }
+      finished.notify_one();
+    }
+  }
+
+  void ParallelMarker::work(Worker& self) {
+    local_stack() = &self.stack;
+    do {
+      while (!self.stack.empty()) {
+        Collectable* object = self.stack.back();
+        self.stack.pop_back();
+        // Checking first keeps threads from writing to objects already marked
+        if (object->marked.load(std::memory_order_relaxed) == epoch ||
+            object->marked.exchange(epoch, std::memory_order_relaxed) == epoch) {
+          continue;
+        }
+        self.marked_bytes += object->size() + sizeof(Cell);
+        object->markChildren();
+        if (self.stack.size() >= SHARE_DEPTH && self.shared_size.load(std::memory_order_relaxed) == 0) {
+          share(self);
+        }
+      }
+    } while (find_work(self));
+    local_stack() = nullptr;
+  }
+
+  // The bottom of the stack was pushed first, so it leads to the most work
+  void ParallelMarker::share(Worker& self) {
+    size_t count = self.stack.size() / 2;
+    std::lock_guard<std::mutex> guard(self.lock);
+    self.shared.insert(self.shared.end(), self.stack.begin(), self.stack.begin() + count);
+    self.stack.erase(self.stack.begin(), self.stack.begin() + count);
+    self.shared_size.store(self.shared.size(), std::memory_order_relaxed);
+  }
+
+  bool ParallelMarker::steal(Worker& self, Worker& victim) {
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (victim.shared.empty()) {
+      return false;
+    }
+    size_t count = (victim.shared.size() + 1) / 2;
+    self.stack.insert(self.stack.end(), victim.shared.begin(), victim.shared.begin() + count);
+    victim.shared.erase(victim.shared.begin(), victim.shared.begin() + count);
+    victim.shared_size.store(victim.shared.size(), std::memory_order_relaxed);
+    return true;
+  }
+
+  /*
+  Takes back what the thread shared, or steals from another thread. Only
+  a thread with work puts anything in its deque, so once every thread is
+  idle, and its deque was empty when it became idle, marking is done.
+  */
+  bool ParallelMarker::find_work(Worker& self) {
+    if (steal(self, self)) {
+      return true;
+    }
+    idle.fetch_add(1);
+    while (true) {
+      for (size_t i = 1; i < workers.size(); i++) {
+        Worker& victim = *workers[(self.id + i) % workers.size()];
+        if (victim.shared_size.load(std::memory_order_relaxed) == 0) {
+          continue;
+        }
+        idle.fetch_sub(1);
+        if (steal(self, victim)) {
+          return true;
+        }
+        idle.fetch_add(1);
+      }
+      if (idle.load() == workers.size()) {
+        return false;
+      }
+      std::this_thread::yield();
+    }
+  }
+}
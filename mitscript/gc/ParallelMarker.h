@@ -0,0 +1,76 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Collectable.h"
+
+namespace GC {
+  /*
+  Marks for full collections on a fixed set of threads, the calling thread
+  being one of them.
+
+  Every thread marks depth first from a private stack. When that stack is
+  deep and the thread's shared deque is empty, the oldest half of the stack
+  is moved to the deque, where idle threads steal from. Objects are claimed
+  by swapping the epoch into their marked field, so each one has its
+  children pushed exactly once.
+
+  markChildren passes children to CollectedHeap::mark, which pushes them to
+  local_stack() while a thread is marking.
+  */
+  class ParallelMarker {
+    struct Worker {
+      size_t id;
+      std::vector<Collectable*> stack;
+      // Accounted size of what the thread marked this round
+      size_t marked_bytes;
+      std::mutex lock;
+      std::deque<Collectable*> shared;
+      // Read without taking the lock, to find something to steal
+      std::atomic<size_t> shared_size{0};
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+
+    // Guards round and stopping, which wake the helper threads
+    std::mutex control;
+    std::condition_variable start;
+    std::condition_variable finished;
+    size_t round = 0;
+    size_t running = 0;
+    bool stopping = false;
+
+    uint32_t epoch = 0;
+    std::atomic<size_t> idle{0};
+
+    void help(size_t id);
+    void work(Worker& self);
+    void share(Worker& self);
+    bool find_work(Worker& self);
+    bool steal(Worker& self, Worker& victim);
+
+  public:
+    explicit ParallelMarker(size_t thread_count);
+    ParallelMarker(const ParallelMarker&) = delete;
+    ParallelMarker& operator=(const ParallelMarker&) = delete;
+    ~ParallelMarker();
+
+    // Marks everything reachable from roots with epoch and returns the
+    // accounted size of what was marked. roots is shared out among the
+    // threads and left empty.
+    size_t mark(std::vector<Collectable*>& roots, uint32_t epoch);
+
+    // The stack of the marking thread, nullptr when it isn't marking
+    static std::vector<Collectable*>*& local_stack() {
+      static thread_local std::vector<Collectable*>* stack = nullptr;
+      return stack;
+    }
+  };
+}
@@ -1,4 +1,5 @@
 #include "Compiler.h"
+#include "../vm/operations.h"
 
 namespace IR {
   shared_ptr<Temp> Compiler::extraTemp() {
@@ -49,6 +50,15 @@ namespace IR {
     return _get_operand(vars, num);
   }
 
+  // Interpreter::load_globals resolves names to slots; the ir tool never
+  // runs it, so there globals keep their index in names_
+  shared_ptr<Glob> Compiler::get_global(BC::Function& func, int32_t name) {
+    if (func.global_slots.empty()) {
+      return get_operand<Glob>((size_t)name);
+    }
+    return get_operand<Glob>((size_t)func.global_slots[name]);
+  }
+
   template<typename T>
   shared_ptr<T> Compiler::get_singleton() {
     static shared_ptr<T> instance = nullptr;
@@ -145,7 +155,7 @@ namespace IR {
           assign(get_operand<Function>((size_t)instruction.operand0.value()));
           break;
         case BC::Operation::LoadGlobal:
-          assign(get_operand<Glob>((size_t)instruction.operand0.value()));
+          assign(get_global(func, instruction.operand0.value()));
           break;
         case BC::Operation::LoadLocal: {
           auto var = get_operand<Var>((size_t)instruction.operand0.value());
@@ -154,7 +164,7 @@ namespace IR {
           break;
         }
         case BC::Operation::LoadConst:
-          assign(make_shared<Const>(func.constants_[instruction.operand0.value()]));
+          assign(make_shared<Const>(VM::Value(func.constant_values[instruction.operand0.value()])));
           break;
         case BC::Operation::StoreReference:
           store(get_operand<Deref>((size_t)instruction.operand0.value()));
@@ -163,7 +173,7 @@ namespace IR {
           store(get_operand<Var>((size_t)instruction.operand0.value()));
           break;
         case BC::Operation::StoreGlobal:
-          store(get_operand<Glob>((size_t)instruction.operand0.value()));
+          store(get_global(func, instruction.operand0.value()));
           break;
         case BC::Operation::Eq: {
           auto arg1 = popTemp();
@@ -221,13 +231,13 @@ namespace IR {
           assign(get_singleton<RetVal>());
           break;
         case BC::Operation::FieldLoad:
-          instructions.push_back(new CallHelper<Helper::FieldLoad>{(size_t)instruction.operand0.value(), popTemp()});
+          instructions.push_back(new CallHelper<Helper::FieldLoad>{(size_t)&VM::field_cache(func, VM::add_field_cache(func, instruction.operand0.value())), popTemp()});
           assign(get_singleton<RetVal>());
           break;
         case BC::Operation::FieldStore: {
           auto value = popTemp();
           auto record = popTemp();
-          instructions.push_back(new CallHelper<Helper::FieldStore>{(size_t)instruction.operand0.value(), record, value});
+          instructions.push_back(new CallHelper<Helper::FieldStore>{(size_t)&VM::field_cache(func, VM::add_field_cache(func, instruction.operand0.value())), record, value});
           break;
         }
         case BC::Operation::IndexLoad: {
@@ -34,6 +34,8 @@ namespace IR {
     template<typename T>
     shared_ptr<T> get_singleton();
 
+    shared_ptr<Glob> get_global(BC::Function& func, int32_t name);
+
     template<typename T>
     shared_ptr<Temp> assign(shared_ptr<T> t);
 
@@ -1,5 +1,6 @@
 #pragma once
 #include "../vm/Value.h"
+#include "../vm/constants.h"
 #include "Exception.h"
 #include "Instructions.h"
 #include "Optimization.h"
@@ -71,17 +72,12 @@ namespace IR {
             if (add->src1->isString() && add->src2->isString()) {
               const char* s1 = add->src1->getConst().getStringConstant();
               const char* s2 = add->src2->getConst().getStringConstant();
-              char* s = new char [strlen(s1)+strlen(s2)+2];
-              strcpy(s, s1);
-              strcat(s, s2);
-              VM::Value v = VM::Value::makeStringConstant(s);
+              VM::Value v = VM::Value::makeStringConstant(VM::intern_constant(std::string(s1) + s2));
 
               compiler.instructions[count] = new Assign<Const>{add->dest, make_shared<Const>(v)};
 
               obsolete.insert(add->src1->num);
               obsolete.insert(add->src2->num);
-              delete[] s1;
-              delete[] s2;
               delete(add);
             } else {
               foldIntsBinOp(add, [] (int a, int b) { return a + b; }, false);
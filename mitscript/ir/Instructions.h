@@ -242,31 +242,6 @@ namespace IR {
       hintConst(val);
     }
 
-    Const(shared_ptr<BC::Constant> constant) {
-      if (auto val = dynamic_pointer_cast<BC::Integer>(constant)) {
-        this->val = VM::Value::makeInteger(val->value).value;
-        hintInt();
-      }
-      else if (auto val = dynamic_pointer_cast<BC::None>(constant)) {
-        this->val = VM::Value::makeNone().value;
-        hintNone();
-      }
-      else if (auto val = dynamic_pointer_cast<BC::Boolean>(constant)) {
-        this->val = VM::Value::makeBoolean(val->value).value;
-        hintBool();
-      }
-      else if (auto val = dynamic_pointer_cast<BC::String>(constant)) {
-        char * cstr = new char [val->value.length()+1];
-        strcpy(cstr, val->value.c_str());
-        this->val = VM::Value::makeStringConstant(cstr).value;
-        hintString();
-      }
-      else {
-        throw "invalid Constant!";
-      }
-      hintConst(val);
-    }
-
     virtual string toString() const override { return "$" + to_string(val); }
   };
 
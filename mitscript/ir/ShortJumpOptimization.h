@@ -11,14 +11,40 @@ namespace IR {
   class ShortJumpOptimization : public Optimization {
     using Optimization::Optimization;
 
+    // Field and index loads carry an inline fast path, which is too long to jump over with a rel8
+    bool is_long(Instruction* instruction) {
+      return dynamic_cast<CallHelper<Helper::FieldLoad>*>(instruction) ||
+             dynamic_cast<CallHelper<Helper::FieldStore>*>(instruction) ||
+             dynamic_cast<CallHelper<Helper::IndexLoad>*>(instruction);
+    }
+
+    bool spans_long(size_t from, size_t to) {
+      for (size_t i = min(from, to); i <= max(from, to); i++) {
+        if (is_long(compiler.instructions[i])) {
+          return true;
+        }
+      }
+      return false;
+    }
+
   public:
     virtual void optimize() {
+      map<size_t, size_t> label_positions;
+      for (size_t i = 0; i < compiler.instructions.size(); i++) {
+        if (auto label = dynamic_cast<OutputLabel*>(compiler.instructions[i])) {
+          label_positions[label->label->num] = i;
+        }
+      }
+
       size_t count = 0;
       for (auto instruction : compiler.instructions) {
         switch (instruction->op()) {
           case IR::Operation::Jump: {
             auto jump = dynamic_cast<Jump*>(instruction);
-            if (abs(count - compiler.bytecode->labels[jump->label->num]) <= SHORT_JUMP_MAX) {
+            auto target = label_positions.find(jump->label->num);
+            if (target != label_positions.end() &&
+                abs((long) count - (long) target->second) <= SHORT_JUMP_MAX &&
+                !spans_long(count, target->second)) {
               compiler.instructions[count] = new ShortJump{jump->label};
               delete(jump);
             }
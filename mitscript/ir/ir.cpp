@@ -3,6 +3,7 @@
 #include "../bcparser/parser.h"
 #include "../bcparser/lexer.h"
 #include "../bccompiler/Compiler.h"
+#include "../vm/constants.h"
 #include "OptimizingCompiler.h"
 #include "PrettyPrinter.h"
 #include <iostream>
@@ -78,6 +79,7 @@ shared_ptr<BC::Function> getBytecodeFunction(int argc, char** argv) {
 int main(int argc, char** argv)
 {
   auto bytecode = getBytecodeFunction(argc, argv);
+  VM::load_constants(*bytecode);
 
   IR::InstructionList instructions;
   IR::OptimizingCompiler compiler(bytecode, instructions);
@@ -2,6 +2,7 @@
 
 static int options = 0;
 static int optimizations = 0;
+static size_t gc_thread_count = 1;
 
 bool has_optimization(size_t optimization) {
     return (optimizations & optimization);
@@ -18,3 +19,11 @@ bool has_option(size_t option) {
 void set_option(size_t option) {
     options |= option;
 }
+
+size_t gc_threads() {
+    return gc_thread_count;
+}
+
+void set_gc_threads(size_t threads) {
+    gc_thread_count = threads ? threads : 1;
+}
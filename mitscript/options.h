@@ -7,13 +7,20 @@
 #define OPTIMIZATION_COMPILE_ONLY         (1 << 2)
 #define OPTIMIZATION_OPTIMIZATION_PASSES  (1 << 3)
 #define OPTIMIZATION_GC_GENERATIONAL      (1 << 4)
+#define OPTIMIZATION_REGISTER_VM          (1 << 5)
+#define OPTIMIZATION_SUPERINSTRUCTIONS    (1 << 6)
+#define OPTIMIZATION_GC_BACKGROUND_SWEEP  (1 << 7)
 
 #define OPTION_COMPILE_ERRORS       (1 << 0)
 #define OPTION_SHOW_MEMORY_USAGE    (1 << 1)
 #define OPTION_SHOW_MEMORY_TRACE    (1 << 2)
+#define OPTION_PROFILE_OPCODES      (1 << 3)
 
 bool has_optimization(size_t option);
 void set_optimization(size_t option);
 
 bool has_option(size_t option);
-void set_option(size_t option);
\ No newline at end of file
+void set_option(size_t option);
+
+size_t gc_threads();
+void set_gc_threads(size_t threads);
@@ -0,0 +1,27 @@
+#!/bin/bash
+
+# Counts the most executed pairs and triples of bytecode instructions over the
+# perf tests, which is what the superinstructions of the stack vm are based on.
+# Usage: ./profile_opcodes.sh [number of sequences to show]
+
+SHOWN=${1:-20}
+
+make vm
+
+profile=$(mktemp)
+for f in tests/PerfTests/*.mit
+do
+  input="${f%.mit}.input"
+  if [[ ! -f "$input" ]]; then
+    input=/dev/null
+  fi
+  ./bin/vm --mem 500 -s "$f" --profile-opcodes < "$input" 2>> "$profile" > /dev/null
+done
+
+for kind in pair triple
+do
+  echo "== ${kind}s"
+  awk -v kind="$kind" '$1 == kind { key = $3; for (i = 4; i <= NF; i++) key = key " " $i; counts[key] += $2 }
+    END { for (key in counts) print counts[key], key }' "$profile" | sort -rn | head -n "$SHOWN"
+done
+rm "$profile"
@@ -119,3 +119,9 @@ for f in tests/staff/test*.mit tests/bytecodetest*.mit tests/asmtest*.mit tests/
 do
   check_interpret_vm_s "$f" "$@"
 done
+
+# Minor collections from compiled code pin what its native frames point to
+for f in tests/asmtest*.mit
+do
+  check_interpret_vm_s "$f" --opt=machine-code-only --opt=gc-generational "$@"
+done
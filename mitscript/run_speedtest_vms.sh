@@ -0,0 +1,25 @@
+#!/bin/bash
+
+# Compares the stack and register interpreters on the perf tests.
+# Usage: ./run_speedtest_vms.sh [extra vm flags]
+
+DEFAULT="\033[39m"
+GREEN="\033[32m"
+
+good() {
+  echo -e "$GREEN ✓ $1 $DEFAULT [$2]"
+}
+
+make vm
+
+for f in tests/PerfTests/*.mit
+do
+  input="${f%.mit}.input"
+  if [[ ! -f "$input" ]]; then
+    input=/dev/null
+  fi
+  good "Running $f" "stack vm"
+  time ./bin/vm --mem 500 -s "$f" "$@" < "$input" > /dev/null
+  good "Running $f" "register vm"
+  time ./bin/vm --mem 500 -s "$f" --opt=register-vm "$@" < "$input" > /dev/null
+done
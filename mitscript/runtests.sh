@@ -4,6 +4,8 @@ DEFAULT="\033[39m"
 GREEN="\033[32m"
 RED="\033[31m"
 MAX_MEM="4096"
+# What the program's own allocations may add to the setup's RSS under --mem 4
+MAX_ALLOC_MEM="2048"
 
 memusg() {
   $@ | tail -1 | cut -d' ' -f1
@@ -31,7 +33,23 @@ check_memory() {
   fi
 }
 
+# Collections have to keep the heap near the limit, not just bound the total
+check_heap() {
+  mem=$(bin/vm --memory-usage --mem 4 -s "$1" 2>&1 >/dev/null | grep "kb actually used by allocs" | cut -d' ' -f1)
+  if [[ "$mem" =~ ^[0-9]+$ ]]; then
+    if [[ "$mem" -lt "$MAX_ALLOC_MEM" ]]; then
+      good "$1" "check_heap $mem kb"
+    else
+      echo "allocations used $mem > $MAX_ALLOC_MEM kb"
+      bad "$1" "check_heap $mem kb"
+    fi
+  else
+    bad "$1" "program was killed or errored"
+  fi
+}
+
 for f in tests/garbagetest*.mit
 do
   check_memory "$f"
+  check_heap "$f"
 done
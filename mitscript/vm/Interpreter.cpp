@@ -1,5 +1,6 @@
 #include "Interpreter.h"
 #include "operations.h"
+#include "constants.h"
 #include <algorithm>
 
 using namespace BC;
@@ -10,12 +11,50 @@ using namespace GC;
 
 namespace VM {
   Interpreter::Interpreter(std::shared_ptr<BC::Function> main_func, size_t max_size) : heap(max_size) {
+    load_constants(*main_func);
+
+    std::unordered_map<BC::Atom, int32_t> slots;
+    load_globals(*main_func, slots);
+    // Slots are never added after loading, so compiled code can address them directly
+    globals.assign(global_names.size(), Value::makeUninitialized());
     main_closure = heap.allocate<ClosureFunctionValue>(main_func);
+
+    // Pages are only touched once a call reaches them
+    stack_base = static_cast<Value*>(malloc(VM_STACK_SIZE * sizeof(Value)));
+    stack_top = stack_base;
+    stack_limit = stack_base + VM_STACK_SIZE;
+    local_reference_variable_stack.reserve(1024);
+  }
+
+  Interpreter::~Interpreter() {
+    free(stack_base);
+  }
+
+  void Interpreter::load_globals(BC::Function& func, std::unordered_map<BC::Atom, int32_t>& slots) {
+    func.global_slots.assign(func.names_.size(), -1);
+    for (Instruction& instruction : func.instructions) {
+      if (instruction.operation != Operation::LoadGlobal && instruction.operation != Operation::StoreGlobal) {
+        continue;
+      }
+      if (!instruction.operand0 || instruction.operand0.value() < 0 || instruction.operand0.value() >= func.names_.size()) {
+        continue;
+      }
+      BC::Atom name = func.names_[instruction.operand0.value()];
+      auto it = slots.find(name);
+      if (it == slots.end()) {
+        it = slots.insert(std::make_pair(name, (int32_t) global_names.size())).first;
+        global_names.push_back(name);
+      }
+      func.global_slots[instruction.operand0.value()] = it->second;
+    }
+    for (auto function : func.functions_) {
+      load_globals(*function, slots);
+    }
   }
 
   int Interpreter::interpret() {
-    std::vector<Value> args;
-    Value val = main_closure->call(args);
+    heap.native_stack_base = __builtin_frame_address(0);
+    Value val = main_closure->call(nullptr, 0);
     if (val.isInteger()) {
       return val.getInteger();
     } else {
@@ -23,37 +62,32 @@ namespace VM {
     }
   };
 
-  void Interpreter::push_frame(Value* local, int local_length, ReferenceValue** local_reference, int reference_length) {
-    local_variable_stack.push_back(std::make_pair(local, local_length));
+  // Reference slots live on the VM stack too, but as raw pointers, so the
+  // collector finds them through these records
+  void Interpreter::push_frame(ReferenceValue** local_reference, int reference_length) {
     local_reference_variable_stack.push_back(std::make_pair(local_reference, reference_length));
   }
 
   void Interpreter::pop_frame() {
-    local_variable_stack.pop_back();
     local_reference_variable_stack.pop_back();
   }
 
-  void Interpreter::push_stack(std::stack<Value>* local_stack) {
-    operand_stack_stack.push_back(local_stack);
-  }
-
-  void Interpreter::pop_stack() {
-    operand_stack_stack.pop_back();
-  }
-
   bool Interpreter::is_top_level() {
-    if (local_variable_stack.size() == 0) {
+    if (local_reference_variable_stack.size() == 0) {
       throw RuntimeException("Cannot call is_top_level, no function is executing");
     }
-    return local_variable_stack.size() == 1;
+    return local_reference_variable_stack.size() == 1;
   }
 
   static uint32_t old_heap_size = 0;
 
+  // Dead objects a full collection left unswept don't count, since they
+  // are freed without another collection
   bool Interpreter::will_garbage_collect() {
+    size_t bytes = heap.surviving_bytes();
     return (
-      (heap.bytes_current >= (old_heap_size + GC_THRASH_THRESHOLD)) &&
-      (heap.bytes_current >= heap.bytes_max * GC_COLLECTION_RATIO)
+      (bytes >= (old_heap_size + GC_THRASH_THRESHOLD)) &&
+      (bytes >= heap.bytes_max * GC_COLLECTION_RATIO)
     );
   }
 
@@ -67,108 +101,121 @@ namespace VM {
       return;
     }
 
-    #ifdef DEBUG
-    std::cout << "$$$$$ Building roots..." << std::endl;
-    #endif
-    std::vector<PointerValue*> roots;
-    roots.push_back(main_closure);
-    for (auto local_variables : local_variable_stack) {
-      for (int i = 0; i < local_variables.second; i++) {
-        Value v = local_variables.first[i];
-        if (v.isPointer()) {
-          roots.push_back(v.getPointerValue());
-        }
-      }
-    }
-    for (auto local_reference_variables : local_reference_variable_stack) {
-      for (int i = 0; i < local_reference_variables.second; i++) {
-        roots.push_back(local_reference_variables.first[i]);
-      }
-    }
-    for (auto local_stack : operand_stack_stack) {
-      std::vector<Value> stack_holder;
-      while (!local_stack->empty()) {
-          auto v = local_stack->top();
-          if (v.isPointer()) {
-            roots.push_back(v.getPointerValue());
-          }
-          stack_holder.insert(stack_holder.begin(), v);
-          local_stack->pop();
-      }
-      for (auto v : stack_holder) {
-          local_stack->push(v);
-      }
-    }
-    for (auto keyvalue : global_variables) {
-      if (keyvalue.second.isPointer()) {
-        roots.push_back(keyvalue.second.getPointerValue());
-      }
-    }
-    #ifdef DEBUG
-    std::cout << "$$$$$ Collecting garbage..." << std::endl;
-    #endif
-
     if (has_optimization(OPTIMIZATION_GC_GENERATIONAL)) {
-      heap.gcFast(roots.begin(), roots.end());
-      if (heap.bytes_current < heap.bytes_max * GC_COLLECTION_RATIO) {
+      #ifdef DEBUG
+      std::cout << "$$$$$ Collecting young garbage..." << std::endl;
+      #endif
+      heap.gcFast([this](GC::CollectedHeap::Evacuator& visit) {
+        visit_roots(visit);
+      });
+      if (heap.surviving_bytes() < heap.bytes_max * GC_COLLECTION_RATIO) {
         heap.successful_fast_collections++;
-        old_heap_size = heap.bytes_current;
+        old_heap_size = heap.surviving_bytes();
         return;
       }
     }
 
-    heap.gcFull(roots.begin(), roots.end());
-    if (heap.bytes_current < heap.bytes_max * GC_COLLECTION_RATIO) {
+    #ifdef DEBUG
+    std::cout << "$$$$$ Collecting garbage..." << std::endl;
+    #endif
+
+    heap.gcFull([this](GC::CollectedHeap::Marker& visit) {
+      visit_roots(visit);
+    });
+    if (heap.surviving_bytes() < heap.bytes_max * GC_COLLECTION_RATIO) {
       heap.successful_full_collections++;
     }
 
-    old_heap_size = heap.bytes_current;
+    old_heap_size = heap.surviving_bytes();
   };
 
-  static Value constant_to_value(CollectedHeap& heap, std::shared_ptr<Constant> constant) {
-      if (std::shared_ptr<None> c = std::dynamic_pointer_cast<None>(constant)) {
-          return Value::makeNone();
-      }
-      if (std::shared_ptr<Integer> c = std::dynamic_pointer_cast<Integer>(constant)) {
-          return Value::makeInteger(c->value);
+  // Operand area of a stack interpreter frame, which is the rest of the VM
+  // stack above the frame's locals. Callees are carved out right above it.
+  struct OperandStack {
+      Value* base;
+      Value* top;
+      Value* limit;
+
+      OperandStack(Value* base, Value* limit) : base(base), top(base), limit(limit) {}
+
+      bool empty() const {
+          return top == base;
       }
-      if (std::shared_ptr<String> c = std::dynamic_pointer_cast<String>(constant)) {
-          return Value::makeStringConstant(c->value.c_str());
+
+      size_t size() const {
+          return top - base;
       }
-      if (std::shared_ptr<Boolean> c = std::dynamic_pointer_cast<Boolean>(constant)) {
-          return Value::makeBoolean(c->value);
+
+      void push(Value value) {
+          if (unlikely(top == limit)) {
+              throw RuntimeException("Ran out of space on the stack!");
+          }
+          *top++ = value;
       }
-      throw RuntimeException("Tried to convert a Function to a Value in constant_to_value (usually called from LoadConst) - should be done in LoadFunc");
-  }
+  };
 
-  template<typename T>
-  static T safe_pop(std::stack<T> &s) {
+  static Value safe_pop(OperandStack &s) {
       if (!s.empty()) {
-          T result = s.top();
-          s.pop();
-          return result;
+          return *--s.top;
       }
       throw InsufficentStackException("Can't pop any more elements off the stack!");
   }
 
-  template<typename T>
-  static T safe_peek(std::stack<T> &s) {
+  static Value safe_peek(OperandStack &s) {
       if (!s.empty()) {
-          return s.top();
+          return s.top[-1];
       }
       throw InsufficentStackException("Can't peek off an empty stack!");
   }
 
-  static void print_stack(std::stack<Value> & stack) {
-      std::vector<Value> stack_holder;
-      while (!stack.empty()) {
-          auto v = stack.top();
-          std::cout << v.toString() << std::endl;
-          stack_holder.insert(stack_holder.begin(), v);
-          stack.pop();
+  static inline bool both_integers(Value left, Value right) {
+      return ((left.value | right.value) & _VALUE_MASK) == _INTEGER_TAG;
+  }
+
+  // The record value points to, or nullptr if it is anything else. Unlike getPointer it never throws
+  static inline RecordValue* as_record(Value value) {
+      if ((value.value & _VALUE_MASK) != _POINTER_TAG) {
+          return nullptr;
+      }
+      PointerValue* pointer = reinterpret_cast<PointerValue*>(value.value & ~_VALUE_MASK);
+      return pointer->pointer_kind() == PointerKind::Record ? static_cast<RecordValue*>(pointer) : nullptr;
+  }
+
+  // Where a quickened field access finds the field in records of the given
+  // shape: the entry of the cache that holds it in operand 1 and the slot in
+  // operand 2. Only fields in the inline slots qualify
+  static bool cached_slot(ThreadedInstruction* instruction, BC::FieldCache& cache, Shape* shape) {
+      for (size_t i = 0; i < FIELD_CACHE_SIZE; i++) {
+          if (cache.shapes[i] == shape) {
+              int64_t slot = cache.slots[i];
+              if (slot < 0 || slot >= RECORD_INLINE_SLOTS) {
+                  return false;
+              }
+              instruction->operand1 = i;
+              instruction->operand2 = slot;
+              return true;
+          }
+      }
+      return false;
+  }
+
+  // Pops a function and its arguments and calls it. The arguments are at the
+  // top of the VM stack, so they become the callee's first locals
+  static Value call_function(Interpreter& interpreter, OperandStack& stack, int32_t num_args) {
+      AbstractFunctionValue* function = safe_pop(stack).getPointer<AbstractFunctionValue>();
+      if (num_args < 0 || stack.size() < (size_t) num_args) {
+          throw InsufficentStackException("Can't pop any more elements off the stack!");
       }
-      for (auto v : stack_holder) {
-          stack.push(v);
+      Value* arguments = stack.top - num_args;
+      interpreter.stack_top = stack.top;
+      Value result = function->call(arguments, num_args);
+      stack.top = arguments;
+      return result;
+  }
+
+  static void print_stack(OperandStack & stack) {
+      for (Value* v = stack.top; v > stack.base; v--) {
+          std::cout << v[-1].toString() << std::endl;
       }
   };
 
@@ -182,432 +229,928 @@ namespace VM {
     }
   }
 
+  static bool has_operand(Operation operation) {
+      switch (operation) {
+          case Operation::LoadConst:
+          case Operation::LoadFunc:
+          case Operation::LoadLocal:
+          case Operation::StoreLocal:
+          case Operation::LoadGlobal:
+          case Operation::StoreGlobal:
+          case Operation::PushReference:
+          case Operation::LoadReference:
+          case Operation::StoreReference:
+          case Operation::FieldLoad:
+          case Operation::FieldStore:
+          case Operation::AllocClosure:
+          case Operation::Call:
+          case Operation::Goto:
+          case Operation::If:
+          case Operation::ThrowUninitialized:
+              return true;
+          default:
+              return false;
+      }
+  }
+
+  // Sequences of instructions run by a single handler when
+  // OPTIMIZATION_SUPERINSTRUCTIONS is on: the hottest sequences that
+  // --profile-opcodes finds in tests/PerfTests
+  enum class SuperOperation {
+      LoadLocal2,         // load_local a; load_local b
+      LoadLocalConst,     // load_local a; load_const c
+      LoadLocalField,     // load_local a; field_load f
+      LoadReferenceField, // load_ref a; field_load f
+      AddLocalConst,      // load_local a; load_const c; add; store_local b
+      GtIf,               // gt; if l
+      GeqIf,              // geq; if l
+      EqIf,               // eq; if l
+      GtIfNot,            // gt; if l1; goto l2; label l1
+      GeqIfNot,           // geq; if l1; goto l2; label l1
+      EqIfNot,            // eq; if l1; goto l2; label l1
+      IfNot,              // if l1; goto l2; label l1
+      CallReturn,         // call n; return
+      CallStoreLocal,     // call n; store_local a
+  };
+
+  static bool is_comparison(Operation operation) {
+      return operation == Operation::Gt || operation == Operation::Geq || operation == Operation::Eq;
+  }
+
+  static SuperOperation comparison_jump(Operation operation, bool negated) {
+      switch (operation) {
+          case Operation::Gt: return negated ? SuperOperation::GtIfNot : SuperOperation::GtIf;
+          case Operation::Geq: return negated ? SuperOperation::GeqIfNot : SuperOperation::GeqIf;
+          default: return negated ? SuperOperation::EqIfNot : SuperOperation::EqIf;
+      }
+  }
+
+  // Replaces the sequences listed in SuperOperation by single instructions.
+  // code is the decoded stream with jumps holding the index they go to and
+  // is_target tells which instructions follow a label; only the first
+  // instruction of a sequence may be jumped to.
+  static void fuse_superinstructions(
+      ThreadedInstructionList& code,
+      const std::vector<bool>& is_target,
+      const void* const* super_handlers,
+      const void* missing_operand
+  ) {
+      ThreadedInstructionList fused;
+      std::vector<bool> is_jump;
+      std::vector<int32_t> new_offsets(code.size() + 1);
+      size_t i = 0;
+      while (i < code.size()) {
+          // Operations of the next instructions, Label where the sequence would be broken
+          Operation ops[4];
+          for (size_t j = 0; j < 4; j++) {
+              size_t k = i + j;
+              bool usable = k < code.size() && code[k].handler != missing_operand && (j == 0 || !is_target[k]);
+              ops[j] = usable ? code[k].operation : Operation::Label;
+              if (!usable) {
+                  for (; j < 4; j++) ops[j] = Operation::Label;
+              }
+          }
+
+          ThreadedInstruction instruction = code[i];
+          SuperOperation super;
+          size_t length = 0;
+          bool jump = false;
+          if (ops[0] == Operation::LoadLocal && ops[1] == Operation::LoadConst && ops[2] == Operation::Add && ops[3] == Operation::StoreLocal) {
+              super = SuperOperation::AddLocalConst;
+              instruction.operand1 = code[i + 1].operand;
+              instruction.operand2 = code[i + 3].operand;
+              length = 4;
+          } else if (is_comparison(ops[0]) && ops[1] == Operation::If && ops[2] == Operation::Goto && code[i + 1].operand == (int32_t) (i + 3)) {
+              super = comparison_jump(ops[0], true);
+              instruction.operand = code[i + 2].operand;
+              length = 3;
+              jump = true;
+          } else if (ops[0] == Operation::If && ops[1] == Operation::Goto && code[i].operand == (int32_t) (i + 2)) {
+              super = SuperOperation::IfNot;
+              instruction.operand = code[i + 1].operand;
+              length = 2;
+              jump = true;
+          } else if (is_comparison(ops[0]) && ops[1] == Operation::If) {
+              super = comparison_jump(ops[0], false);
+              instruction.operand = code[i + 1].operand;
+              length = 2;
+              jump = true;
+          } else if (ops[0] == Operation::LoadLocal && ops[1] == Operation::FieldLoad) {
+              super = SuperOperation::LoadLocalField;
+              instruction.operand1 = code[i + 1].operand;
+              length = 2;
+          } else if (ops[0] == Operation::LoadReference && ops[1] == Operation::FieldLoad) {
+              super = SuperOperation::LoadReferenceField;
+              instruction.operand1 = code[i + 1].operand;
+              length = 2;
+          } else if (ops[0] == Operation::LoadLocal && ops[1] == Operation::LoadLocal) {
+              super = SuperOperation::LoadLocal2;
+              instruction.operand1 = code[i + 1].operand;
+              length = 2;
+          } else if (ops[0] == Operation::LoadLocal && ops[1] == Operation::LoadConst) {
+              super = SuperOperation::LoadLocalConst;
+              instruction.operand1 = code[i + 1].operand;
+              length = 2;
+          } else if (ops[0] == Operation::Call && ops[1] == Operation::Return) {
+              super = SuperOperation::CallReturn;
+              length = 2;
+          } else if (ops[0] == Operation::Call && ops[1] == Operation::StoreLocal) {
+              super = SuperOperation::CallStoreLocal;
+              instruction.operand1 = code[i + 1].operand;
+              length = 2;
+          }
+
+          new_offsets[i] = fused.size();
+          if (length == 0) {
+              fused.push_back(instruction);
+              is_jump.push_back(instruction.handler != missing_operand &&
+                  (instruction.operation == Operation::Goto || instruction.operation == Operation::If));
+              i++;
+          } else {
+              instruction.handler = super_handlers[static_cast<int>(super)];
+              instruction.operation = Operation::Label;
+              fused.push_back(instruction);
+              is_jump.push_back(jump);
+              i += length;
+          }
+      }
+      new_offsets[code.size()] = fused.size();
+
+      for (size_t j = 0; j < fused.size(); j++) {
+          if (is_jump[j]) {
+              fused[j].operand = new_offsets[fused[j].operand];
+          }
+      }
+      code.swap(fused);
+  }
+
+  // Decodes func.instructions into func.threaded_instructions, where each
+  // instruction holds the address of its handler in run_function. Labels are
+  // dropped and jumps point directly at the instruction following their label;
+  // a jump to an unknown label goes to the start of the function, as a lookup
+  // in func.labels would. The stream ends with a jump to the `end` handler.
+  //
+  // With --profile-opcodes every instruction goes through the `profile`
+  // handler first, which counts it and then jumps to its real handler.
+  static void thread_function(
+      BC::Function& func,
+      const void* const* handlers,
+      const void* const* super_handlers,
+      const void* missing_operand,
+      const void* end,
+      const void* profile
+  ) {
+      std::map<int32_t, int32_t> label_offsets;
+      int32_t offset = 0;
+      for (Instruction& instruction : func.instructions) {
+          if (instruction.operation == Operation::Label) {
+              if (instruction.operand0) {
+                  label_offsets[instruction.operand0.value()] = offset;
+              }
+          } else {
+              offset++;
+          }
+      }
+
+      ThreadedInstructionList& code = func.threaded_instructions;
+      std::vector<bool> is_target(offset + 1, false);
+      code.clear();
+      code.reserve(offset + 1);
+      for (Instruction& instruction : func.instructions) {
+          if (instruction.operation == Operation::Label) {
+              is_target[code.size()] = true;
+              continue;
+          }
+          ThreadedInstruction threaded = {handlers[static_cast<int>(instruction.operation)], 0, 0, 0, instruction.operation};
+          if (has_operand(instruction.operation)) {
+              if (!instruction.operand0) {
+                  threaded.handler = missing_operand;
+              } else if (instruction.operation == Operation::Goto || instruction.operation == Operation::If) {
+                  auto target = label_offsets.find(instruction.operand0.value());
+                  threaded.operand = target == label_offsets.end() ? 0 : target->second;
+              } else if (instruction.operation == Operation::FieldLoad || instruction.operation == Operation::FieldStore) {
+                  threaded.operand = add_field_cache(func, instruction.operand0.value());
+              } else {
+                  threaded.operand = instruction.operand0.value();
+              }
+          }
+          if (has_option(OPTION_PROFILE_OPCODES) && threaded.handler != missing_operand) {
+              threaded.handler = profile;
+          }
+          code.push_back(threaded);
+      }
+
+      if (has_optimization(OPTIMIZATION_SUPERINSTRUCTIONS) && !has_option(OPTION_PROFILE_OPCODES)) {
+          fuse_superinstructions(code, is_target, super_handlers, missing_operand);
+      }
+      code.push_back({end, 0, 0, 0, Operation::Label});
+      func.is_threaded = true;
+  }
+
+  static const char* operation_name(uint32_t operation) {
+      static const char* names[] = {"LoadConst", "LoadFunc", "LoadLocal", "StoreLocal", "LoadGlobal", "StoreGlobal", "PushReference", "LoadReference", "StoreReference", "AllocRecord", "FieldLoad", "FieldStore", "IndexLoad", "IndexStore", "AllocClosure", "Call", "Return", "Add", "Sub", "Mul", "Div", "Neg", "Gt", "Geq", "Eq", "And", "Or", "Not", "Goto", "If", "Dup", "Swap", "Pop", "GarbageCollect", "Label", "ThrowUninitialized"};
+      return names[operation];
+  }
+
+  // Prints the most executed sequences of two and three adjacent instructions,
+  // one per line as "pair|triple <count> <operations...>", so that runs over
+  // several programs can be summed (see profile_opcodes.sh)
+  void Interpreter::print_opcode_profile(std::ostream& out) {
+      const size_t shown = 30;
+      std::vector<std::pair<uint64_t, uint32_t>> sorted;
+      for (auto& counts : {std::make_pair("pair", &opcode_pairs), std::make_pair("triple", &opcode_triples)}) {
+          sorted.clear();
+          for (auto& entry : *counts.second) {
+              sorted.push_back(std::make_pair(entry.second, entry.first));
+          }
+          std::sort(sorted.rbegin(), sorted.rend());
+          for (size_t i = 0; i < sorted.size() && i < shown; i++) {
+              out << counts.first << " " << sorted[i].first;
+              uint32_t key = sorted[i].second;
+              size_t length = counts.second == &opcode_pairs ? 2 : 3;
+              for (size_t j = length; j > 0; j--) {
+                  out << " " << operation_name((key >> (8 * (j - 1))) & 0xff);
+              }
+              out << std::endl;
+          }
+      }
+      out << "total " << opcode_count << std::endl;
+  }
+
   Value Interpreter::run_function(
       ClosureFunctionValue* closure,
       Value* local_variables,
       ReferenceValue** local_reference_vars
   ) {
+      // Handlers in the order of BC::Operation
+      static const void* const handlers[] = {
+          &&LoadConst, &&LoadFunc, &&LoadLocal, &&StoreLocal, &&LoadGlobal, &&StoreGlobal,
+          &&PushReference, &&LoadReference, &&StoreReference, &&AllocRecord, &&FieldLoad,
+          &&FieldStore, &&IndexLoad, &&IndexStore, &&AllocClosure, &&Call, &&Return,
+          &&Add, &&Sub, &&Mul, &&Div, &&Neg, &&Gt, &&Geq, &&Eq, &&And, &&Or, &&Not,
+          &&Goto, &&If, &&Dup, &&Swap, &&Pop, &&GarbageCollect, &&Label, &&ThrowUninitialized
+      };
+      // Handlers in the order of SuperOperation
+      static const void* const super_handlers[] = {
+          &&LoadLocal2, &&LoadLocalConst, &&LoadLocalField, &&LoadReferenceField, &&AddLocalConst,
+          &&GtIf, &&GeqIf, &&EqIf, &&GtIfNot, &&GeqIfNot, &&EqIfNot, &&IfNot, &&CallReturn, &&CallStoreLocal
+      };
+
       BC::Function& func = *closure->value;
-      std::stack<Value> stack;
-
-      push_stack(&stack);
-
-      int ip = 0;
-      while (ip >= 0 && ip < func.instructions.size()) {
-          Instruction instruction = func.instructions[ip];
-          int new_ip = ip + 1;
-          #if DEBUG
-          std::cout << "ip: " << ip << std::endl;
-          std::cout << "Instruction: " << instruction.toString() << std::endl;
-          #endif
-          switch (instruction.operation) {
-              // Description: push a constant onto the operand stack
-              // Operand 0: index of constant in enclosing function's list of constants
-              // Mnemonic:  load_const i
-              // Stack:      S => f.constants()[i] :: S
-              case Operation::LoadConst: {
-                  stack.push(constant_to_value(heap, safe_index(func.constants_, instruction.operand0.value())));
-              }
-              break;
-
-              // Description: push a  function onto the operand stack
-              // Operand 0: index of function  in enclosing function's list of functions
-              // Mnemonic:  load_func i
-              // Stack:      S => f.functions()[i] :: S
-              case Operation::LoadFunc: {
-                  int index = instruction.operand0.value();
-                  stack.push(allocateFunction(closure, index));
-              }
-              break;
-
-              // Description: load value of local variable and push onto operand stack
-              // Operand 0: index of local variable to read
-              // Mnemonic: load_local i
-              // S => S :: value_of(f.local_vars[i])
-              case Operation::LoadLocal: {
-                  stack.push(local_variables[instruction.operand0.value()]);
-              }
-              break;
-
-              // Description: store top of operand stack into local variable
-              // Operand 0: index of local variable to store into
-              // Operand 1: value to store
-              // Mnemonic:  store_local i
-              // Stack:     S :: operand 1==> S
-              case Operation::StoreLocal: {
-                  local_variables[instruction.operand0.value()] = safe_pop(stack);
-              }
-              break;
-
-              // Description: load value of global variable
-              // Operand 0: index of name of global variable in enclosing function's names list
-              // Mnemonic:  load_global i
-              // Stack:     S => global_value_of(f.names[i]) :: S
-              case Operation::LoadGlobal: {
-                  std::string var_name = safe_index(func.names_, instruction.operand0.value());
-                  if (global_variables.count(var_name) == 0) {
-                      throw UninitializedVariableException(var_name + " has not been assigned yet, but it has been used");
-                  }
-                  stack.push(global_variables.at(var_name));
-              }
-              break;
-
-              // Description: store value into global variable
-              // Operand 0: index of name of global variable in enclosing function's names list
-              // Operand 1: value to store
-              // Mnemonic:  store_global i
-              // Stack:     S :: operand 1 ==> S
-              case Operation::StoreGlobal: {
-                  std::string var_name = safe_index(func.names_, instruction.operand0.value());
-                  global_variables[var_name] = safe_pop(stack);
-              }
-              break;
-
-              // Description: push a reference to a local variable or free variable reference onto the operand stack
-              // Operand 0: index of local variable reference
-              // Mnemonic:  push_ref i
-              // Stack:     S ==>  address_of(var) :: S
-              //            wehere var = i < f.local_reference_vars.size() ? f.local_reference_vars[i]
-              //                                                           :  f.free_vars[i - f.local_reference_vars.size()]
-              case Operation::PushReference:{
-                  int index = instruction.operand0.value();
-                  stack.push(Value::makePointer(local_reference_vars[index]));
-              }
-              break;
-
-              // Description: loads the value of a reference onto the operand stack
-              // Operand 0: index of local variable reference
-              // Mnemonic:  load_ref
-              // Stack:     S :: operand 1 => S :: value_of(operand 1)
-              case Operation::LoadReference: {
-                  int index = instruction.operand0.value();
-                  ReferenceValue* rv = local_reference_vars[index];
-                  stack.push(rv->value);
-              }
-              break;
-
-              // Description: loads the value of a reference onto the operand stack
-              // Operand 0: reference to load from
-              // Operand 1: value to store
-              // Mnemonic:  load_ref
-              // Stack:     S :: operand 2 :: operand 1 => S
-              case Operation::StoreReference: {
-                  Value value = safe_pop(stack);
-                  int index = instruction.operand0.value();
-                  ReferenceValue* rv = local_reference_vars[index];
-                  rv->write(value);
-              }
-              break;
-
-              // Description: allocates a record and pushes it on the operand stack
-              // Operand 0: N/A
-              // Mnemonic:  alloc_record
-              // Stack:     S => S :: record
-              case Operation::AllocRecord: {
-                  stack.push(Value::makePointer(heap.allocate<RecordValue>()));
-              }
-              break;
-
-              // Description: load value of field from record
-              // Operand 0: index of the field's name within the enclosing function's names list
-              // Operand 1: record from which to load
-              // Mnemonic: field_load i
-              // Stack:     S :: operand 1 => S :: record_value_of(operand, f.names[i])
-              case Operation::FieldLoad: {
-                  std::string var_name = safe_index(func.names_, instruction.operand0.value());
-                  RecordValue* rv = safe_pop(stack).getPointer<RecordValue>();
-                  stack.push(rv->get(var_name));
-              }
-              break;
-
-              // Description: store value into field of record
-              // Operand 0: index of the field's name within the enclosing function's names list
-              // Operand 1: the value to store
-              // Operand 2: the record to store into
-              // Mnemonic: field_store i
-              // Stack:    S :: operand 2 :: operand 1 => S
-              case Operation::FieldStore: {
-                  std::string var_name = safe_index(func.names_, instruction.operand0.value());
-                  Value stored_value = safe_pop(stack);
-                  RecordValue* rv = safe_pop(stack).getPointer<RecordValue>();
-                  rv->insert(var_name, stored_value);
-              }
-              break;
-
-              // Description: load value from index of record
-              // Operand 0: N/A
-              // Operand 1: the index to read from (can be arbitrary value. indexing adheres to semantics of Assignment #2)
-              // Operand 2: the record to read from
-              // Stack:     S :: operand 2 :: operand 1 => S
-              case Operation::IndexLoad: {
-                  Value index_value = safe_pop(stack);
-                  std::string var_name = index_value.toString();
-                  RecordValue* rv = safe_pop(stack).getPointer<RecordValue>();
-                  stack.push(rv->get(var_name));
-              }
-              break;
-
-              // Description: store value into index of record
-              // Operand 0: N/A
-              // Operand 1: the value to store
-              // Operand 2: the index to store to (can be arbitrary value. indexing adheres to semantics of Assignment #2)
-              // Operand 3: the record to store into
-              // Stack:     S :: operand 3 :: operand 2 :: operand 1 => S
-              case Operation::IndexStore: {
-                  Value stored_value = safe_pop(stack);
-                  Value index_value = safe_pop(stack);
-                  std::string var_name = index_value.toString();
-                  RecordValue* rv = safe_pop(stack).getPointer<RecordValue>();
-                  rv->insert(var_name, stored_value);
-              }
-              break;
-
-              // Description: allocate a closure
-              // Operand 0:       the number of free variable references passed to the closure
-              // Operand 1:       function
-              // Operand 2:  - N: references to the function's free variables
-              // Mnemonic:   alloc_closure
-              // Stack:      S :: operand n :: ... :: operand 3 :: operand 2 :: operand 1 => S :: closure
-              case Operation::AllocClosure: {
-                  BareFunctionValue* function = safe_pop(stack).getPointer<BareFunctionValue>();
-                  int32_t num_vars = instruction.operand0.value();
-                  ClosureFunctionValue* closure = heap.allocate<ClosureFunctionValue>(function->value);
-                  for (int i = 0; i < num_vars; i++) {
-                      ReferenceValue* reference_value = safe_pop(stack).getPointer<ReferenceValue>();
-                      closure->add_reference(reference_value);
-                  }
-                  stack.push(Value::makePointer(closure));
-              }
-              break;
-
-              // Description: call a closure
-              // Operand 0:     number of arguments
-              // Operand 1:     closure to call (closure reference)
-              // Operand 2 - N: argument ((N - 2) - i)
-              // Mnemonic:      call
-              // Stack:         S::operand n :: .. :: operand 3 :: operand 2 :: operand 1 => S :: value
-              case Operation::Call: {
-                  AbstractFunctionValue* function = safe_pop(stack).getPointer<AbstractFunctionValue>();
-                  int32_t num_args = instruction.operand0.value();
-                  std::vector<Value> arguments;
-                  for (int i = 0; i < num_args; i++) {
-                      arguments.push_back(safe_pop(stack));
-                  }
-                  std::reverse(arguments.begin(), arguments.end());
-                  stack.push(function->call(arguments));
-              }
-              break;
-
-              // Description: ends the execution of the enclosing function and returns the top of the stack
-              // Operand 0:   N/A
-              // Operand 1:   value to return
-              // Mnemonic:    return
-              // Stack::      S :: operand 1 => S
-              case Operation::Return: {
-                  pop_stack();
-                  return safe_peek(stack);
-              }
-              break;
-
-              // Description: implements addition (as given in the semantics of Assignment #2)
-              // Operand 0: N/A
-              // Operand 1: right value
-              // Operand 2: left value
-              // Result:    value of the operation as specified by the semantics of Assignment #2
-              // Mnemonic:  sub/mul/div
-              // Stack:     S:: operand 2 :: operand 1 => S :: op(operand 2, operand 1)
-
-              case Operation::Add: {
-                  Value operand_1 = safe_pop(stack);
-                  Value operand_2 = safe_pop(stack);
-                  stack.push(add(operand_2, operand_1));
-              }
-              break;
-
-              // Description: performs an arithmetic operation on two integer operands
-              // Operand 0: N/A
-              // Operand 1: right value
-              // Operand 2: left value
-              // Mnemonic:  sub/mul/div
-              // Stack:     S:: operand 2 :: operand 1 => S :: op(operand 2, operand 1)
-
-
-              // Description: computes a comparison operation on two integer operands
-              // Operand 0: N/A
-              // Operand 1: right value
-              // Operand 2: left value
-              // Mnemonic:  gt/geq
-              // Stack:     S :: operand 2 :: operand 1 => S:: op(operand 2, operand 1)
-              case Operation::Gt: {
-                  Value operand_1 = safe_pop(stack);
-                  Value operand_2 = safe_pop(stack);
-                  stack.push(Value::makeBoolean(operand_2.getInteger() > operand_1.getInteger()));
-              }
-              break;
+      if (!func.is_threaded) {
+          thread_function(func, handlers, super_handlers, &&MissingOperand, &&End, &&Profile);
+      }
 
-              case Operation::Geq: {
-                  Value operand_1 = safe_pop(stack);
-                  Value operand_2 = safe_pop(stack);
-                  stack.push(Value::makeBoolean(operand_2.getInteger() >= operand_1.getInteger()));
+      OperandStack stack(stack_top, stack_limit);
+
+      ThreadedInstruction* const instructions = func.threaded_instructions.data();
+      ThreadedInstruction* instruction = instructions;
+      // Last operations run (plus one, 0 when there is none) and where the next one should be, for Profile
+      uint32_t profile_history = 0;
+      const ThreadedInstruction* profile_next = nullptr;
+
+      #if DEBUG
+      #define DISPATCH() do { \
+          std::cout << "ip: " << (instruction - instructions) << std::endl; \
+          std::cout << "Stack:" << std::endl; \
+          print_stack(stack); \
+          std::cout << "----------" << std::endl; \
+          goto *instruction->handler; \
+      } while (0)
+      #else
+      #define DISPATCH() goto *instruction->handler
+      #endif
+      #define NEXT() do { instruction++; DISPATCH(); } while (0)
+
+      // Quickening: the first time some instructions run they replace their
+      // handler by a form specialized for the values they saw, which keeps a
+      // cheap guard and on a miss turns the instruction into the generic form
+      // for good. The profiler needs to see every handler, so it turns this off
+      static const bool quicken = !has_option(OPTION_PROFILE_OPCODES);
+      static const bool generational = has_optimization(OPTIMIZATION_GC_GENERATIONAL);
+      #define QUICKEN(label) do { if (quicken) instruction->handler = &&label; } while (0)
+
+      DISPATCH();
+
+      // Description: push a constant onto the operand stack
+      // Operand 0: index of constant in enclosing function's list of constants
+      // Mnemonic:  load_const i
+      // Stack:      S => f.constants()[i] :: S
+      LoadConst: {
+          stack.push(Value(safe_index(func.constant_values, instruction->operand)));
+      }
+      NEXT();
+
+      // Description: push a  function onto the operand stack
+      // Operand 0: index of function  in enclosing function's list of functions
+      // Mnemonic:  load_func i
+      // Stack:      S => f.functions()[i] :: S
+      LoadFunc: {
+          stack.push(allocateFunction(closure, instruction->operand));
+      }
+      NEXT();
+
+      // Description: load value of local variable and push onto operand stack
+      // Operand 0: index of local variable to read
+      // Mnemonic: load_local i
+      // S => S :: value_of(f.local_vars[i])
+      LoadLocal: {
+          stack.push(local_variables[instruction->operand]);
+      }
+      NEXT();
+
+      // Description: store top of operand stack into local variable
+      // Operand 0: index of local variable to store into
+      // Operand 1: value to store
+      // Mnemonic:  store_local i
+      // Stack:     S :: operand 1==> S
+      StoreLocal: {
+          local_variables[instruction->operand] = safe_pop(stack);
+      }
+      NEXT();
+
+      // Description: load value of global variable
+      // Operand 0: index of name of global variable in enclosing function's names list
+      // Mnemonic:  load_global i
+      // Stack:     S => global_value_of(f.names[i]) :: S
+      LoadGlobal: {
+          Value value = globals[safe_index(func.global_slots, instruction->operand)];
+          if (value.isUninitialized()) {
+              throw UninitializedVariableException(func.names_[instruction->operand].str() + " has not been assigned yet, but it has been used");
+          }
+          stack.push(value);
+      }
+      NEXT();
+
+      // Description: store value into global variable
+      // Operand 0: index of name of global variable in enclosing function's names list
+      // Operand 1: value to store
+      // Mnemonic:  store_global i
+      // Stack:     S :: operand 1 ==> S
+      StoreGlobal: {
+          globals[safe_index(func.global_slots, instruction->operand)] = safe_pop(stack);
+      }
+      NEXT();
+
+      // Description: push a reference to a local variable or free variable reference onto the operand stack
+      // Operand 0: index of local variable reference
+      // Mnemonic:  push_ref i
+      // Stack:     S ==>  address_of(var) :: S
+      //            wehere var = i < f.local_reference_vars.size() ? f.local_reference_vars[i]
+      //                                                           :  f.free_vars[i - f.local_reference_vars.size()]
+      PushReference: {
+          stack.push(Value::makePointer(local_reference_vars[instruction->operand]));
+      }
+      NEXT();
+
+      // Description: loads the value of a reference onto the operand stack
+      // Operand 0: index of local variable reference
+      // Mnemonic:  load_ref
+      // Stack:     S :: operand 1 => S :: value_of(operand 1)
+      LoadReference: {
+          ReferenceValue* rv = local_reference_vars[instruction->operand];
+          stack.push(rv->value);
+      }
+      NEXT();
+
+      // Description: loads the value of a reference onto the operand stack
+      // Operand 0: reference to load from
+      // Operand 1: value to store
+      // Mnemonic:  load_ref
+      // Stack:     S :: operand 2 :: operand 1 => S
+      StoreReference: {
+          Value value = safe_pop(stack);
+          ReferenceValue* rv = local_reference_vars[instruction->operand];
+          rv->write(value);
+      }
+      NEXT();
+
+      // Description: allocates a record and pushes it on the operand stack
+      // Operand 0: N/A
+      // Mnemonic:  alloc_record
+      // Stack:     S => S :: record
+      AllocRecord: {
+          stack.push(Value::makePointer(heap.allocate<RecordValue>()));
+      }
+      NEXT();
+
+      // Description: load value of field from record
+      // Operand 0: index of the field's name within the enclosing function's names list
+      // Operand 1: record from which to load
+      // Mnemonic: field_load i
+      // Stack:     S :: operand 1 => S :: record_value_of(operand, f.names[i])
+      FieldLoad: {
+          BC::FieldCache& cache = field_cache(func, instruction->operand);
+          RecordValue* rv = safe_pop(stack).getPointer<RecordValue>();
+          stack.push(rv->get(cache));
+          if (rv->shape != nullptr && cached_slot(instruction, cache, rv->shape)) {
+              QUICKEN(FieldLoadCached);
+          } else {
+              QUICKEN(FieldLoadGeneric);
+          }
+      }
+      NEXT();
+
+      // Records of the shape the cache entry in operand 1 holds, whose field is in inline slot operand 2
+      FieldLoadCached: {
+          BC::FieldCache& cache = func.field_caches[instruction->operand];
+          RecordValue* rv = as_record(safe_peek(stack));
+          if (rv != nullptr && rv->shape == cache.shapes[instruction->operand1]) {
+              stack.top[-1] = rv->slots[instruction->operand2];
+              NEXT();
+          }
+          QUICKEN(FieldLoadGeneric);
+      }
+      FieldLoadGeneric: {
+          BC::FieldCache& cache = field_cache(func, instruction->operand);
+          RecordValue* rv = safe_pop(stack).getPointer<RecordValue>();
+          stack.push(rv->get(cache));
+      }
+      NEXT();
+
+      // Description: store value into field of record
+      // Operand 0: index of the field's name within the enclosing function's names list
+      // Operand 1: the value to store
+      // Operand 2: the record to store into
+      // Mnemonic: field_store i
+      // Stack:    S :: operand 2 :: operand 1 => S
+      FieldStore: {
+          BC::FieldCache& cache = field_cache(func, instruction->operand);
+          Value stored_value = safe_pop(stack);
+          RecordValue* rv = safe_pop(stack).getPointer<RecordValue>();
+          Shape* shape = rv->shape;
+          rv->insert(cache, stored_value);
+          // Stores that add the field change the shape, those stay generic
+          if (shape != nullptr && shape == rv->shape && cached_slot(instruction, cache, shape)) {
+              QUICKEN(FieldStoreCached);
+          } else {
+              QUICKEN(FieldStoreGeneric);
+          }
+      }
+      NEXT();
+
+      // Pointers stored into records need the write barrier when collecting by generations
+      FieldStoreCached: {
+          if (stack.size() >= 2) {
+              BC::FieldCache& cache = func.field_caches[instruction->operand];
+              Value stored_value = stack.top[-1];
+              RecordValue* rv = as_record(stack.top[-2]);
+              if (rv != nullptr && rv->shape == cache.shapes[instruction->operand1] &&
+                  !(generational && stored_value.isPointer())) {
+                  rv->slots[instruction->operand2] = stored_value;
+                  stack.top -= 2;
+                  NEXT();
               }
-              break;
+          }
+          QUICKEN(FieldStoreGeneric);
+      }
+      FieldStoreGeneric: {
+          BC::FieldCache& cache = field_cache(func, instruction->operand);
+          Value stored_value = safe_pop(stack);
+          RecordValue* rv = safe_pop(stack).getPointer<RecordValue>();
+          rv->insert(cache, stored_value);
+      }
+      NEXT();
+
+      // Description: load value from index of record
+      // Operand 0: N/A
+      // Operand 1: the index to read from (can be arbitrary value. indexing adheres to semantics of Assignment #2)
+      // Operand 2: the record to read from
+      // Stack:     S :: operand 2 :: operand 1 => S
+      IndexLoad: {
+          Value index_value = safe_pop(stack);
+          RecordValue* rv = safe_pop(stack).getPointer<RecordValue>();
+          stack.push(rv->get(index_value));
+      }
+      NEXT();
+
+      // Description: store value into index of record
+      // Operand 0: N/A
+      // Operand 1: the value to store
+      // Operand 2: the index to store to (can be arbitrary value. indexing adheres to semantics of Assignment #2)
+      // Operand 3: the record to store into
+      // Stack:     S :: operand 3 :: operand 2 :: operand 1 => S
+      IndexStore: {
+          Value stored_value = safe_pop(stack);
+          Value index_value = safe_pop(stack);
+          RecordValue* rv = safe_pop(stack).getPointer<RecordValue>();
+          rv->insert(index_value, stored_value);
+      }
+      NEXT();
+
+      // Description: allocate a closure
+      // Operand 0:       the number of free variable references passed to the closure
+      // Operand 1:       function
+      // Operand 2:  - N: references to the function's free variables
+      // Mnemonic:   alloc_closure
+      // Stack:      S :: operand n :: ... :: operand 3 :: operand 2 :: operand 1 => S :: closure
+      AllocClosure: {
+          BareFunctionValue* function = safe_pop(stack).getPointer<BareFunctionValue>();
+          int32_t num_vars = instruction->operand;
+          ClosureFunctionValue* new_closure = heap.allocate<ClosureFunctionValue>(function->value);
+          for (int i = 0; i < num_vars; i++) {
+              ReferenceValue* reference_value = safe_pop(stack).getPointer<ReferenceValue>();
+              new_closure->add_reference(reference_value);
+          }
+          stack.push(Value::makePointer(new_closure));
+      }
+      NEXT();
+
+      // Description: call a closure
+      // Operand 0:     number of arguments
+      // Operand 1:     closure to call (closure reference)
+      // Operand 2 - N: argument ((N - 2) - i)
+      // Mnemonic:      call
+      // Stack:         S::operand n :: .. :: operand 3 :: operand 2 :: operand 1 => S :: value
+      Call: {
+          stack.push(call_function(*this, stack, instruction->operand));
+      }
+      NEXT();
+
+      // Description: ends the execution of the enclosing function and returns the top of the stack
+      // Operand 0:   N/A
+      // Operand 1:   value to return
+      // Mnemonic:    return
+      // Stack::      S :: operand 1 => S
+      Return: {
+          return safe_peek(stack);
+      }
 
-              case Operation::Sub: {
-                  Value operand_1 = safe_pop(stack);
-                  Value operand_2 = safe_pop(stack);
-                  stack.push(Value::makeInteger(operand_2.getInteger() - operand_1.getInteger()));
-              }
-              break;
+      // Description: implements addition (as given in the semantics of Assignment #2)
+      // Operand 0: N/A
+      // Operand 1: right value
+      // Operand 2: left value
+      // Result:    value of the operation as specified by the semantics of Assignment #2
+      // Mnemonic:  sub/mul/div
+      // Stack:     S:: operand 2 :: operand 1 => S :: op(operand 2, operand 1)
+      Add: {
+          Value operand_1 = safe_pop(stack);
+          Value operand_2 = safe_pop(stack);
+          if (both_integers(operand_2, operand_1)) {
+              QUICKEN(AddInt);
+          } else {
+              QUICKEN(AddGeneric);
+          }
+          stack.push(add(operand_2, operand_1));
+      }
+      NEXT();
+
+      AddInt: {
+          Value operand_1 = safe_pop(stack);
+          Value operand_2 = safe_pop(stack);
+          if (both_integers(operand_2, operand_1)) {
+              // Integers are stored times 8, so their sum is the sum of their words
+              stack.push(Value(operand_2.value + operand_1.value));
+              NEXT();
+          }
+          QUICKEN(AddGeneric);
+          stack.push(add(operand_2, operand_1));
+      }
+      NEXT();
 
-              case Operation::Mul: {
-                  Value operand_1 = safe_pop(stack);
-                  Value operand_2 = safe_pop(stack);
-                  stack.push(Value::makeInteger(operand_2.getInteger() * operand_1.getInteger()));
-              }
-              break;
-
-              case Operation::Div: {
-                  Value operand_1 = safe_pop(stack);
-                  Value operand_2 = safe_pop(stack);
-                  if (operand_1.getInteger() == 0) {
-                      throw IllegalArithmeticException("divide by zero");
-                  }
-                  stack.push(Value::makeInteger(operand_2.getInteger() / operand_1.getInteger()));
-              }
-              break;
-
-              // Description: computes the unary minus of the integer operation
-              // Operand 0: N/A
-              // Operand 1: value
-              // Mnemonic:  neg
-              // Stack:     S :: operand 1 => S:: - operand 1
-              case Operation::Neg: {
-                  stack.push(Value::makeInteger(-safe_pop(stack).getInteger()));
-              }
-              break;
-
-
-              // Description: computes an equality between two values (semantics according to Assignment #2)
-              // Operand 0: N/A
-              // Operand 1: right value
-              // Operand 2: left value
-              // Mnemonic:  gt/geq
-              // Stack:     S :: operand 2 :: operand 1 => S:: eq(operand 2, operand 1)
-              case Operation::Eq: {
-                  Value operand_1 = safe_pop(stack);
-                  Value operand_2 = safe_pop(stack);
-                  stack.push(equals(operand_2, operand_1));
-              }
-              break;
-
-              // Description: computes a boolean operation on two boolean operands
-              // Operand 0: N/A
-              // Operand 1: right value
-              // Operand 2: left value
-              // Mnemonic:  and/or
-              // Stack:     S :: operand 2 :: operand 1 => S:: op(operand 2, operand 1)
-              case Operation::And: {
-                  Value operand_1 = safe_pop(stack);
-                  Value operand_2 = safe_pop(stack);
-                  stack.push(Value::makeBoolean(operand_2.getBoolean() && operand_1.getBoolean()));
-              }
-              break;
+      AddGeneric: {
+          Value operand_1 = safe_pop(stack);
+          Value operand_2 = safe_pop(stack);
+          stack.push(add(operand_2, operand_1));
+      }
+      NEXT();
+
+      // Description: performs an arithmetic operation on two integer operands
+      // Operand 0: N/A
+      // Operand 1: right value
+      // Operand 2: left value
+      // Mnemonic:  sub/mul/div
+      // Stack:     S:: operand 2 :: operand 1 => S :: op(operand 2, operand 1)
+      Sub: {
+          Value operand_1 = safe_pop(stack);
+          Value operand_2 = safe_pop(stack);
+          stack.push(Value::makeInteger(operand_2.getInteger() - operand_1.getInteger()));
+      }
+      NEXT();
 
-              case Operation::Or: {
-                  Value operand_1 = safe_pop(stack);
-                  Value operand_2 = safe_pop(stack);
-                  stack.push(Value::makeBoolean(operand_2.getBoolean() || operand_1.getBoolean()));
-              }
-              break;
-
-              // Description: computes the logical negation of a boolean operand
-              // Operand 0: N/A
-              // Operand 1: value
-              // Mnemonic:  and/or
-              // Stack:     S :: operand 1 => S:: op(operand 1)
-              case Operation::Not: {
-                  stack.push(Value::makeBoolean(!safe_pop(stack).getBoolean()));
-              }
-              break;
-
-
-              // Description: transfers execution of the function to a new instruction offset within the current function
-              // Example: goto 0 jumps to the current instruction. goto 1 jumps to the following instruction. goto -1 jumps to the preceeding instruction
-              // Operand 0: offset relative to the current instruction offset to jump to.
-              // Mnemonic:  goto i
-              // Stack:     S => S
-              case Operation::Goto:
-                  new_ip = func.labels[instruction.operand0.value()];
-              break;
-
-              // Description: transfers execution of the function to a new instruction offset within the current function if the operand evaluates to true
-              // Operand 0: offset relative to the current instruction offset to jump to.
-              // Operand 1: value
-              // Mnemonic:  if i
-              // Stack:     S :: operand 1 => S
-              case Operation::If: {
-                  if (safe_pop(stack).getBoolean()) {
-                      new_ip = func.labels[instruction.operand0.value()];
-                  }
-              }
-              break;
-
-              // Description: duplicates the element at the top of the stack.
-              // If this element is a reference to a record, function, or local variable, the operation only depulicates the reference
-              // Operand 0: N/A
-              // Operand 1: value
-              // Mnemonic:  dup
-              // Stack:     S :: operand 1 => S :: operand 1 :: operand 1
-              case Operation::Dup:
-                  stack.push(safe_peek(stack));
-              break;
-
-              // Description: swaps the two values at the top of the stack
-              // Operand 0: N/A
-              // Operand 1: a value
-              // Operand 2: a value
-              // Mnemonic:  swap
-              // Stack:     S :: operand 2 :: operand 1 => S :: operand 1 :: operand 2
-              case Operation::Swap: {
-                  Value operand_1 = safe_pop(stack);
-                  Value operand_2 = safe_pop(stack);
-                  stack.push(operand_1);
-                  stack.push(operand_2);
-              }
-              break;
-
-              // Description: pops and discards the top of the stack
-              // Operand 0: N/A
-              // Operand 1: a value
-              // Mnemonic:  swap
-              // Stack:     S :: operand 1 => S
-              case Operation::Pop:
-                  safe_pop(stack);
-              break;
-
-              case Operation::GarbageCollect:
-                  potentially_garbage_collect();
-              break;
-
-              case Operation::Label:
-              break;
-
-              case Operation::ThrowUninitialized:
-                throw UninitializedVariableException(func.names_[instruction.operand0.value()]);
-                break;
-
-              default:
-                  throw RuntimeException("Found an unknown opcode.");
-              break;
-          };
-          #if DEBUG
-          std::cout << "Stack:" << std::endl;
-          print_stack(stack);
-          std::cout << "----------" << std::endl;
-          #endif
-          ip = new_ip;
-      }
-      pop_stack();
-      return Value::makeNone();
+      Mul: {
+          Value operand_1 = safe_pop(stack);
+          Value operand_2 = safe_pop(stack);
+          stack.push(Value::makeInteger(operand_2.getInteger() * operand_1.getInteger()));
+      }
+      NEXT();
+
+      Div: {
+          Value operand_1 = safe_pop(stack);
+          Value operand_2 = safe_pop(stack);
+          if (operand_1.getInteger() == 0) {
+              throw IllegalArithmeticException("divide by zero");
+          }
+          stack.push(Value::makeInteger(operand_2.getInteger() / operand_1.getInteger()));
+      }
+      NEXT();
+
+      // Description: computes the unary minus of the integer operation
+      // Operand 0: N/A
+      // Operand 1: value
+      // Mnemonic:  neg
+      // Stack:     S :: operand 1 => S:: - operand 1
+      Neg: {
+          stack.push(Value::makeInteger(-safe_pop(stack).getInteger()));
+      }
+      NEXT();
+
+      // Description: computes a comparison operation on two integer operands
+      // Operand 0: N/A
+      // Operand 1: right value
+      // Operand 2: left value
+      // Mnemonic:  gt/geq
+      // Stack:     S :: operand 2 :: operand 1 => S:: op(operand 2, operand 1)
+      Gt: {
+          Value operand_1 = safe_pop(stack);
+          Value operand_2 = safe_pop(stack);
+          stack.push(Value::makeBoolean(operand_2.getInteger() > operand_1.getInteger()));
+      }
+      NEXT();
+
+      Geq: {
+          Value operand_1 = safe_pop(stack);
+          Value operand_2 = safe_pop(stack);
+          stack.push(Value::makeBoolean(operand_2.getInteger() >= operand_1.getInteger()));
+      }
+      NEXT();
+
+      // Description: computes an equality between two values (semantics according to Assignment #2)
+      // Operand 0: N/A
+      // Operand 1: right value
+      // Operand 2: left value
+      // Mnemonic:  gt/geq
+      // Stack:     S :: operand 2 :: operand 1 => S:: eq(operand 2, operand 1)
+      Eq: {
+          Value operand_1 = safe_pop(stack);
+          Value operand_2 = safe_pop(stack);
+          if (operand_1.isString() && operand_2.isString()) {
+              QUICKEN(EqGeneric);
+          } else {
+              QUICKEN(EqIdentity);
+          }
+          stack.push(equals(operand_2, operand_1));
+      }
+      NEXT();
+
+      // Anything but two strings is equal exactly when the words are
+      EqIdentity: {
+          Value operand_1 = safe_pop(stack);
+          Value operand_2 = safe_pop(stack);
+          if (!(operand_1.isString() && operand_2.isString())) {
+              stack.push(Value::makeBoolean(operand_2.value == operand_1.value));
+              NEXT();
+          }
+          QUICKEN(EqGeneric);
+          stack.push(equals(operand_2, operand_1));
+      }
+      NEXT();
+
+      EqGeneric: {
+          Value operand_1 = safe_pop(stack);
+          Value operand_2 = safe_pop(stack);
+          stack.push(equals(operand_2, operand_1));
+      }
+      NEXT();
+
+      // Description: computes a boolean operation on two boolean operands
+      // Operand 0: N/A
+      // Operand 1: right value
+      // Operand 2: left value
+      // Mnemonic:  and/or
+      // Stack:     S :: operand 2 :: operand 1 => S:: op(operand 2, operand 1)
+      And: {
+          Value operand_1 = safe_pop(stack);
+          Value operand_2 = safe_pop(stack);
+          stack.push(Value::makeBoolean(operand_2.getBoolean() && operand_1.getBoolean()));
+      }
+      NEXT();
+
+      Or: {
+          Value operand_1 = safe_pop(stack);
+          Value operand_2 = safe_pop(stack);
+          stack.push(Value::makeBoolean(operand_2.getBoolean() || operand_1.getBoolean()));
+      }
+      NEXT();
+
+      // Description: computes the logical negation of a boolean operand
+      // Operand 0: N/A
+      // Operand 1: value
+      // Mnemonic:  and/or
+      // Stack:     S :: operand 1 => S:: op(operand 1)
+      Not: {
+          stack.push(Value::makeBoolean(!safe_pop(stack).getBoolean()));
+      }
+      NEXT();
+
+      // Description: transfers execution of the function to a new instruction offset within the current function
+      // Operand 0: offset of the decoded instruction to jump to
+      // Mnemonic:  goto i
+      // Stack:     S => S
+      Goto: {
+          instruction = instructions + instruction->operand;
+      }
+      DISPATCH();
+
+      // Description: transfers execution of the function to a new instruction offset within the current function if the operand evaluates to true
+      // Operand 0: offset of the decoded instruction to jump to
+      // Operand 1: value
+      // Mnemonic:  if i
+      // Stack:     S :: operand 1 => S
+      If: {
+          if (safe_pop(stack).getBoolean()) {
+              instruction = instructions + instruction->operand;
+              DISPATCH();
+          }
+      }
+      NEXT();
+
+      // Description: duplicates the element at the top of the stack.
+      // If this element is a reference to a record, function, or local variable, the operation only depulicates the reference
+      // Operand 0: N/A
+      // Operand 1: value
+      // Mnemonic:  dup
+      // Stack:     S :: operand 1 => S :: operand 1 :: operand 1
+      Dup: {
+          stack.push(safe_peek(stack));
+      }
+      NEXT();
+
+      // Description: swaps the two values at the top of the stack
+      // Operand 0: N/A
+      // Operand 1: a value
+      // Operand 2: a value
+      // Mnemonic:  swap
+      // Stack:     S :: operand 2 :: operand 1 => S :: operand 1 :: operand 2
+      Swap: {
+          Value operand_1 = safe_pop(stack);
+          Value operand_2 = safe_pop(stack);
+          stack.push(operand_1);
+          stack.push(operand_2);
+      }
+      NEXT();
+
+      // Description: pops and discards the top of the stack
+      // Operand 0: N/A
+      // Operand 1: a value
+      // Mnemonic:  swap
+      // Stack:     S :: operand 1 => S
+      Pop: {
+          safe_pop(stack);
+      }
+      NEXT();
+
+      GarbageCollect: {
+          stack_top = stack.top;
+          potentially_garbage_collect();
+      }
+      NEXT();
+
+      // Labels are dropped when decoding, this is never reached
+      Label:
+      NEXT();
+
+      ThrowUninitialized: {
+          throw UninitializedVariableException(func.names_[instruction->operand]);
+      }
+
+      // Superinstructions, see SuperOperation. Operands 1 and 2 are those of
+      // the second and last instruction of the sequence
+
+      LoadLocal2: {
+          stack.push(local_variables[instruction->operand]);
+          stack.push(local_variables[instruction->operand1]);
+      }
+      NEXT();
+
+      LoadLocalConst: {
+          stack.push(local_variables[instruction->operand]);
+          stack.push(Value(safe_index(func.constant_values, instruction->operand1)));
+      }
+      NEXT();
+
+      LoadLocalField: {
+          BC::FieldCache& cache = field_cache(func, instruction->operand1);
+          RecordValue* rv = local_variables[instruction->operand].getPointer<RecordValue>();
+          stack.push(rv->get(cache));
+      }
+      NEXT();
+
+      LoadReferenceField: {
+          BC::FieldCache& cache = field_cache(func, instruction->operand1);
+          RecordValue* rv = local_reference_vars[instruction->operand]->value.getPointer<RecordValue>();
+          stack.push(rv->get(cache));
+      }
+      NEXT();
+
+      AddLocalConst: {
+          Value constant = Value(safe_index(func.constant_values, instruction->operand1));
+          Value local = local_variables[instruction->operand];
+          if (both_integers(local, constant)) {
+              QUICKEN(AddLocalConstInt);
+          } else {
+              QUICKEN(AddLocalConstGeneric);
+          }
+          local_variables[instruction->operand2] = add(local, constant);
+      }
+      NEXT();
+
+      AddLocalConstInt: {
+          Value constant = Value(func.constant_values[instruction->operand1]);
+          Value local = local_variables[instruction->operand];
+          if (both_integers(local, constant)) {
+              local_variables[instruction->operand2] = Value(local.value + constant.value);
+              NEXT();
+          }
+          QUICKEN(AddLocalConstGeneric);
+      }
+      AddLocalConstGeneric: {
+          Value constant = Value(safe_index(func.constant_values, instruction->operand1));
+          local_variables[instruction->operand2] = add(local_variables[instruction->operand], constant);
+      }
+      NEXT();
+
+      #define COMPARE_JUMP(test, negated) do { \
+          Value operand_1 = safe_pop(stack); \
+          Value operand_2 = safe_pop(stack); \
+          if ((test) != (negated)) { \
+              instruction = instructions + instruction->operand; \
+              DISPATCH(); \
+          } \
+      } while (0)
+
+      GtIf:
+      COMPARE_JUMP(operand_2.getInteger() > operand_1.getInteger(), false);
+      NEXT();
+
+      GeqIf:
+      COMPARE_JUMP(operand_2.getInteger() >= operand_1.getInteger(), false);
+      NEXT();
+
+      EqIf:
+      COMPARE_JUMP(operand_2 == operand_1, false);
+      NEXT();
+
+      GtIfNot:
+      COMPARE_JUMP(operand_2.getInteger() > operand_1.getInteger(), true);
+      NEXT();
+
+      GeqIfNot:
+      COMPARE_JUMP(operand_2.getInteger() >= operand_1.getInteger(), true);
+      NEXT();
+
+      EqIfNot:
+      COMPARE_JUMP(operand_2 == operand_1, true);
+      NEXT();
+
+      #undef COMPARE_JUMP
+
+      IfNot: {
+          if (!safe_pop(stack).getBoolean()) {
+              instruction = instructions + instruction->operand;
+              DISPATCH();
+          }
+      }
+      NEXT();
+
+      CallReturn: {
+          return call_function(*this, stack, instruction->operand);
+      }
+
+      CallStoreLocal: {
+          local_variables[instruction->operand1] = call_function(*this, stack, instruction->operand);
+      }
+      NEXT();
+
+      MissingOperand: {
+          throw RuntimeException("Instruction is missing its operand.");
+      }
+
+      // Counts the instruction together with the one or two before it, as long
+      // as they were run one after the other without a jump in between
+      Profile: {
+          uint32_t operation = static_cast<uint32_t>(instruction->operation);
+          if (instruction != profile_next) {
+              profile_history = 0;
+          }
+          opcode_count++;
+          if (profile_history & 0xff) {
+              opcode_pairs[((profile_history & 0xff) - 1) << 8 | operation]++;
+          }
+          if (profile_history & 0xff00) {
+              opcode_triples[((profile_history >> 8 & 0xff) - 1) << 16 | ((profile_history & 0xff) - 1) << 8 | operation]++;
+          }
+          profile_history = (profile_history << 8 | (operation + 1)) & 0xffffff;
+          profile_next = instruction + 1;
+          goto *handlers[operation];
+      }
+
+      End: {
+          return Value::makeNone();
+      }
+
+      #undef QUICKEN
+      #undef NEXT
+      #undef DISPATCH
   }
 }
@@ -1,38 +1,73 @@
 #pragma once
 
 #include <string>
+#include <ostream>
 #include <vector>
 #include <map>
-#include <stack>
+#include <unordered_map>
 #include "../bccompiler/Types.h"
 #include "../gc/Collectable.h"
 #include "../gc/CollectedHeap.h"
 #include "Value.fwd.h"
 #include "Interpreter.fwd.h"
 
-namespace VM {
+// Number of values the VM stack can hold, it is reserved up front and never moves
+#define VM_STACK_SIZE (1 << 22)
 
-  typedef std::map<std::string, Value> ValueMap;
+namespace VM {
 
   struct Interpreter {
       ClosureFunctionValue* main_closure;
-      ValueMap global_variables;
-      std::vector<std::pair<Value*, int>> local_variable_stack;
+      std::vector<Value> globals;
+      std::vector<BC::Atom> global_names;
+      // Frames of all active calls, back to back (see ClosureFunctionValue::call).
+      // Everything below stack_top is a GC root
+      Value* stack_base;
+      Value* stack_top;
+      Value* stack_limit;
       std::vector<std::pair<ReferenceValue**, int>> local_reference_variable_stack;
-      std::vector<std::stack<Value>*> operand_stack_stack;
+      // Executed pairs and triples of operations, packed a byte each, counted with --profile-opcodes
+      std::unordered_map<uint32_t, uint64_t> opcode_pairs;
+      std::unordered_map<uint32_t, uint64_t> opcode_triples;
+      uint64_t opcode_count = 0;
       GC::CollectedHeap heap;
       Interpreter(std::shared_ptr<BC::Function> main_func, size_t max_size);
+      ~Interpreter();
+      void load_globals(BC::Function& func, std::unordered_map<BC::Atom, int32_t>& slots);
       int interpret();
       Value run_function(ClosureFunctionValue* closure, Value* local_variables, ReferenceValue** local_reference_vars);
-      void push_frame(Value* local, int local_length, ReferenceValue** local_reference, int reference_length);
+      Value run_register_function(ClosureFunctionValue* closure, Value* registers, ReferenceValue** local_reference_vars);
+      void push_frame(ReferenceValue** local_reference, int reference_length);
       void pop_frame();
-      void push_stack(std::stack<Value>* local_stack);
-      void pop_stack();
       bool is_top_level();
+      void print_opcode_profile(std::ostream& out);
 
       bool will_garbage_collect();
       void potentially_garbage_collect();
+      // Calls visit with every GC root slot in place, see GC::CollectedHeap::Evacuator
+      template<typename VISIT>
+      void visit_roots(VISIT& visit);
   };
 }
 
 #include "Value.h"
+
+namespace VM {
+  // The main closure, the VM stack up to stack_top, which holds every frame's
+  // locals and operand area, the reference slots of each frame, and globals
+  template<typename VISIT>
+  void Interpreter::visit_roots(VISIT& visit) {
+    visit(main_closure);
+    for (Value* v = stack_base; v < stack_top; v++) {
+      visit(v->value);
+    }
+    for (auto& local_reference_variables : local_reference_variable_stack) {
+      for (int i = 0; i < local_reference_variables.second; i++) {
+        visit(local_reference_variables.first[i]);
+      }
+    }
+    for (Value& v : globals) {
+      visit(v.value);
+    }
+  }
+}
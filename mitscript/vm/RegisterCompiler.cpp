@@ -0,0 +1,318 @@
+#include "RegisterCompiler.h"
+#include "InterpreterException.h"
+#include "operations.h"
+
+#include <algorithm>
+
+using namespace BC;
+
+// Placeholder for the scratch register, which sits above the deepest temporary
+// and so is only known once the whole function has been translated.
+#define SCRATCH_REGISTER -1
+
+namespace VM {
+  // Temporaries come after the locals, the reference slots and the closure slot of the frame
+  int32_t RegisterCompiler::temp(size_t depth) {
+    return func.local_vars_.size() + func.local_reference_vars_.size() + func.free_vars_.size() + 1 + depth;
+  }
+
+  int32_t RegisterCompiler::reg(const Entry& entry) {
+    return entry.is_local ? entry.index : temp(entry.index);
+  }
+
+  RegisterCompiler::Entry RegisterCompiler::pop() {
+    if (stack.empty()) {
+      throw InsufficentStackException("Can't pop any more elements off the stack!");
+    }
+    Entry entry = stack.back();
+    stack.pop_back();
+    return entry;
+  }
+
+  int32_t RegisterCompiler::push() {
+    size_t depth = stack.size();
+    stack.push_back({false, (int32_t) depth});
+    max_depth = std::max(max_depth, stack.size());
+    return temp(depth);
+  }
+
+  void RegisterCompiler::emit(RegisterOperation op, int32_t a, int32_t b, int32_t c) {
+    out.push_back(RegisterInstruction(op, a, b, c));
+  }
+
+  void RegisterCompiler::materialize(size_t from) {
+    for (size_t i = from; i < stack.size(); i++) {
+      if (stack[i].is_local) {
+        emit(RegisterOperation::Move, temp(i), stack[i].index);
+        stack[i] = {false, (int32_t) i};
+      }
+    }
+  }
+
+  void RegisterCompiler::materializeLocal(int32_t local) {
+    for (size_t i = 0; i < stack.size(); i++) {
+      if (stack[i].is_local && stack[i].index == local) {
+        emit(RegisterOperation::Move, temp(i), local);
+        stack[i] = {false, (int32_t) i};
+      }
+    }
+  }
+
+  void RegisterCompiler::binary(RegisterOperation op) {
+    Entry right = pop();
+    Entry left = pop();
+    emit(op, push(), reg(left), reg(right));
+  }
+
+  void RegisterCompiler::unary(RegisterOperation op) {
+    Entry operand = pop();
+    emit(op, push(), reg(operand));
+  }
+
+  void RegisterCompiler::jump(RegisterOperation op, int32_t label, int32_t cond) {
+    materialize();
+    label_depths[label] = stack.size();
+    jumps.push_back(out.size());
+    emit(op, label, cond);
+  }
+
+  static bool writes_first_operand(RegisterOperation op) {
+    switch (op) {
+      case RegisterOperation::StoreGlobal:
+      case RegisterOperation::StoreReference:
+      case RegisterOperation::FieldStore:
+      case RegisterOperation::IndexStore:
+      case RegisterOperation::AllocClosure:
+      case RegisterOperation::Call:
+      case RegisterOperation::Return:
+      case RegisterOperation::Goto:
+      case RegisterOperation::If:
+      case RegisterOperation::GarbageCollect:
+      case RegisterOperation::ThrowUninitialized:
+        return false;
+      default:
+        return true;
+    }
+  }
+
+  void RegisterCompiler::compile() {
+    out.clear();
+    bool live = true;
+    size_t barrier = 0;
+
+    for (Instruction& instruction : func.instructions) {
+      switch (instruction.operation) {
+        case Operation::LoadConst:
+          emit(RegisterOperation::LoadConst, push(), instruction.operand0.value());
+          break;
+
+        case Operation::LoadFunc:
+          emit(RegisterOperation::LoadFunc, push(), instruction.operand0.value());
+          break;
+
+        case Operation::LoadLocal:
+          stack.push_back({true, instruction.operand0.value()});
+          max_depth = std::max(max_depth, stack.size());
+          break;
+
+        case Operation::StoreLocal: {
+          int32_t local = instruction.operand0.value();
+          Entry value = pop();
+          if (value.is_local && value.index == local) {
+            break;
+          }
+          materializeLocal(local);
+          // The value was produced by the instruction just emitted, so have
+          // it write into the local directly instead of going through a temporary.
+          if (!value.is_local && out.size() > barrier &&
+              writes_first_operand(out.back().operation) && out.back().a == reg(value)) {
+            out.back().a = local;
+          } else {
+            emit(RegisterOperation::Move, local, reg(value));
+          }
+        }
+        break;
+
+        case Operation::LoadGlobal:
+          emit(RegisterOperation::LoadGlobal, push(), instruction.operand0.value());
+          break;
+
+        case Operation::StoreGlobal:
+          emit(RegisterOperation::StoreGlobal, instruction.operand0.value(), reg(pop()));
+          break;
+
+        case Operation::PushReference:
+          emit(RegisterOperation::PushReference, push(), instruction.operand0.value());
+          break;
+
+        case Operation::LoadReference:
+          emit(RegisterOperation::LoadReference, push(), instruction.operand0.value());
+          break;
+
+        case Operation::StoreReference:
+          emit(RegisterOperation::StoreReference, instruction.operand0.value(), reg(pop()));
+          break;
+
+        case Operation::AllocRecord:
+          emit(RegisterOperation::AllocRecord, push());
+          break;
+
+        case Operation::FieldLoad: {
+          Entry record = pop();
+          emit(RegisterOperation::FieldLoad, push(), reg(record), add_field_cache(func, instruction.operand0.value()));
+        }
+        break;
+
+        case Operation::FieldStore: {
+          Entry value = pop();
+          Entry record = pop();
+          emit(RegisterOperation::FieldStore, reg(record), add_field_cache(func, instruction.operand0.value()), reg(value));
+        }
+        break;
+
+        case Operation::IndexLoad: {
+          Entry index = pop();
+          Entry record = pop();
+          emit(RegisterOperation::IndexLoad, push(), reg(record), reg(index));
+        }
+        break;
+
+        case Operation::IndexStore: {
+          Entry value = pop();
+          Entry index = pop();
+          Entry record = pop();
+          emit(RegisterOperation::IndexStore, reg(record), reg(index), reg(value));
+        }
+        break;
+
+        // The callee (or function) and its arguments (or references) must sit
+        // in consecutive registers, so they are forced into their temporaries.
+        case Operation::AllocClosure:
+        case Operation::Call: {
+          int32_t count = instruction.operand0.value();
+          if (count < 0 || stack.size() < (size_t) count + 1) {
+            throw InsufficentStackException("Can't pop any more elements off the stack!");
+          }
+          materialize(stack.size() - count - 1);
+          stack.resize(stack.size() - count - 1);
+          RegisterOperation op = instruction.operation == Operation::Call ? RegisterOperation::Call : RegisterOperation::AllocClosure;
+          emit(op, push(), count);
+        }
+        break;
+
+        case Operation::Return:
+          emit(RegisterOperation::Return, reg(pop()));
+          live = false;
+          break;
+
+        case Operation::Add: binary(RegisterOperation::Add); break;
+        case Operation::Sub: binary(RegisterOperation::Sub); break;
+        case Operation::Mul: binary(RegisterOperation::Mul); break;
+        case Operation::Div: binary(RegisterOperation::Div); break;
+        case Operation::Gt: binary(RegisterOperation::Gt); break;
+        case Operation::Geq: binary(RegisterOperation::Geq); break;
+        case Operation::Eq: binary(RegisterOperation::Eq); break;
+        case Operation::And: binary(RegisterOperation::And); break;
+        case Operation::Or: binary(RegisterOperation::Or); break;
+        case Operation::Neg: unary(RegisterOperation::Neg); break;
+        case Operation::Not: unary(RegisterOperation::Not); break;
+
+        case Operation::Goto:
+          jump(RegisterOperation::Goto, instruction.operand0.value());
+          live = false;
+          break;
+
+        case Operation::If: {
+          Entry cond = pop();
+          jump(RegisterOperation::If, instruction.operand0.value(), reg(cond));
+        }
+        break;
+
+        case Operation::Label: {
+          int32_t label = instruction.operand0.value();
+          if (live) {
+            materialize();
+          } else if (label_depths.count(label)) {
+            stack.clear();
+            for (size_t i = 0; i < label_depths[label]; i++) {
+              stack.push_back({false, (int32_t) i});
+            }
+          }
+          live = true;
+          label_offsets[label] = out.size();
+          barrier = out.size();
+        }
+        break;
+
+        case Operation::Dup: {
+          if (stack.empty()) {
+            throw InsufficentStackException("Can't peek off an empty stack!");
+          }
+          Entry top = stack.back();
+          if (top.is_local) {
+            stack.push_back(top);
+            max_depth = std::max(max_depth, stack.size());
+          } else {
+            emit(RegisterOperation::Move, push(), reg(top));
+          }
+        }
+        break;
+
+        case Operation::Swap: {
+          Entry first = pop();
+          Entry second = pop();
+          size_t depth = stack.size();
+          if (first.is_local && second.is_local) {
+            stack.push_back(first);
+            stack.push_back(second);
+          } else if (first.is_local) {
+            emit(RegisterOperation::Move, temp(depth + 1), temp(depth));
+            stack.push_back(first);
+            stack.push_back({false, (int32_t) depth + 1});
+          } else if (second.is_local) {
+            emit(RegisterOperation::Move, temp(depth), temp(depth + 1));
+            stack.push_back({false, (int32_t) depth});
+            stack.push_back(second);
+          } else {
+            emit(RegisterOperation::Move, SCRATCH_REGISTER, temp(depth + 1));
+            emit(RegisterOperation::Move, temp(depth + 1), temp(depth));
+            emit(RegisterOperation::Move, temp(depth), SCRATCH_REGISTER);
+            stack.push_back({false, (int32_t) depth});
+            stack.push_back({false, (int32_t) depth + 1});
+          }
+        }
+        break;
+
+        case Operation::Pop:
+          pop();
+          break;
+
+        case Operation::GarbageCollect:
+          emit(RegisterOperation::GarbageCollect);
+          break;
+
+        case Operation::ThrowUninitialized:
+          emit(RegisterOperation::ThrowUninitialized, instruction.operand0.value());
+          break;
+
+        default:
+          throw RuntimeException("Found an unknown opcode.");
+      }
+    }
+
+    int32_t scratch = temp(max_depth);
+    for (RegisterInstruction& instruction : out) {
+      if (instruction.operation == RegisterOperation::Move) {
+        if (instruction.a == SCRATCH_REGISTER) instruction.a = scratch;
+        if (instruction.b == SCRATCH_REGISTER) instruction.b = scratch;
+      }
+    }
+    for (size_t jump : jumps) {
+      int32_t label = out[jump].a;
+      out[jump].a = label_offsets.count(label) ? label_offsets[label] : 0;
+    }
+
+    func.register_count = scratch + 1;
+    func.is_register_compiled = true;
+  }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "../bccompiler/Types.h"
+#include "../bccompiler/RegisterInstructions.h"
+
+#include <map>
+#include <vector>
+
+namespace VM {
+  // Translates the stack bytecode of a BC::Function into register form.
+  //
+  // The register file of a frame is laid out as
+  // [locals | references | closure | temporaries | scratch], matching the
+  // frames built by ClosureFunctionValue::call. Only locals and temporaries are
+  // ever named by instructions.
+  // The operand stack is tracked symbolically: an entry is either a local
+  // variable that has not been copied yet, or the temporary whose index
+  // matches its stack depth. Loads of locals therefore cost nothing, and the
+  // result of an operation that is immediately stored to a local is written
+  // straight into that local.
+  class RegisterCompiler {
+    struct Entry {
+      bool is_local;
+      int32_t index;
+    };
+
+    BC::Function& func;
+    BC::RegisterInstructionList& out;
+    std::vector<Entry> stack;
+    std::map<int32_t, size_t> label_depths;
+    std::map<int32_t, size_t> label_offsets;
+    std::vector<size_t> jumps;
+    size_t max_depth = 0;
+
+    int32_t temp(size_t depth);
+    int32_t reg(const Entry& entry);
+    Entry pop();
+    int32_t push();
+    void emit(BC::RegisterOperation op, int32_t a = 0, int32_t b = 0, int32_t c = 0);
+    void materialize(size_t from = 0);
+    void materializeLocal(int32_t local);
+    void binary(BC::RegisterOperation op);
+    void unary(BC::RegisterOperation op);
+    void jump(BC::RegisterOperation op, int32_t label, int32_t cond = 0);
+
+  public:
+    RegisterCompiler(BC::Function& func) : func(func), out(func.register_instructions) {}
+    void compile();
+  };
+}
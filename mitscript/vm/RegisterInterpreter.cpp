@@ -0,0 +1,201 @@
+#include "Interpreter.h"
+#include "operations.h"
+
+using namespace BC;
+
+namespace VM {
+  // Dispatch loop for the register form of a function (see RegisterCompiler).
+  // `registers` is the frame pushed by ClosureFunctionValue::call, so every
+  // temporary is a GC root without needing an operand stack.
+  Value Interpreter::run_register_function(
+      ClosureFunctionValue* closure,
+      Value* registers,
+      ReferenceValue** local_reference_vars
+  ) {
+      BC::Function& func = *closure->value;
+      RegisterInstruction* instructions = func.register_instructions.data();
+      size_t instruction_count = func.register_instructions.size();
+      Value* r = registers;
+      // End of this frame on the VM stack, restored after every call
+      Value* frame_end = stack_top;
+
+      size_t ip = 0;
+      while (ip < instruction_count) {
+          const RegisterInstruction& instruction = instructions[ip];
+          ip++;
+          #if DEBUG
+          std::cout << "ip: " << ip - 1 << std::endl;
+          std::cout << "Instruction: " << instruction.toString() << std::endl;
+          #endif
+          switch (instruction.operation) {
+              case RegisterOperation::Move:
+                  r[instruction.a] = r[instruction.b];
+              break;
+
+              case RegisterOperation::LoadConst:
+                  r[instruction.a] = Value(safe_index(func.constant_values, instruction.b));
+              break;
+
+              case RegisterOperation::LoadFunc:
+                  r[instruction.a] = allocateFunction(closure, instruction.b);
+              break;
+
+              case RegisterOperation::LoadGlobal: {
+                  Value value = globals[safe_index(func.global_slots, instruction.b)];
+                  if (value.isUninitialized()) {
+                      throw UninitializedVariableException(func.names_[instruction.b].str() + " has not been assigned yet, but it has been used");
+                  }
+                  r[instruction.a] = value;
+              }
+              break;
+
+              case RegisterOperation::StoreGlobal: {
+                  globals[safe_index(func.global_slots, instruction.a)] = r[instruction.b];
+              }
+              break;
+
+              case RegisterOperation::PushReference:
+                  r[instruction.a] = Value::makePointer(local_reference_vars[instruction.b]);
+              break;
+
+              case RegisterOperation::LoadReference:
+                  r[instruction.a] = local_reference_vars[instruction.b]->value;
+              break;
+
+              case RegisterOperation::StoreReference:
+                  local_reference_vars[instruction.a]->write(r[instruction.b]);
+              break;
+
+              case RegisterOperation::AllocRecord:
+                  r[instruction.a] = Value::makePointer(heap.allocate<RecordValue>());
+              break;
+
+              case RegisterOperation::FieldLoad: {
+                  BC::FieldCache& cache = field_cache(func, instruction.c);
+                  RecordValue* rv = r[instruction.b].getPointer<RecordValue>();
+                  r[instruction.a] = rv->get(cache);
+              }
+              break;
+
+              case RegisterOperation::FieldStore: {
+                  BC::FieldCache& cache = field_cache(func, instruction.b);
+                  RecordValue* rv = r[instruction.a].getPointer<RecordValue>();
+                  rv->insert(cache, r[instruction.c]);
+              }
+              break;
+
+              case RegisterOperation::IndexLoad: {
+                  RecordValue* rv = r[instruction.b].getPointer<RecordValue>();
+                  r[instruction.a] = rv->get(r[instruction.c]);
+              }
+              break;
+
+              case RegisterOperation::IndexStore: {
+                  RecordValue* rv = r[instruction.a].getPointer<RecordValue>();
+                  rv->insert(r[instruction.b], r[instruction.c]);
+              }
+              break;
+
+              case RegisterOperation::AllocClosure: {
+                  int32_t num_vars = instruction.b;
+                  BareFunctionValue* function = r[instruction.a + num_vars].getPointer<BareFunctionValue>();
+                  ClosureFunctionValue* new_closure = heap.allocate<ClosureFunctionValue>(function->value);
+                  for (int i = num_vars - 1; i >= 0; i--) {
+                      new_closure->add_reference(r[instruction.a + i].getPointer<ReferenceValue>());
+                  }
+                  r[instruction.a] = Value::makePointer(new_closure);
+              }
+              break;
+
+              case RegisterOperation::Call: {
+                  int32_t num_args = instruction.b;
+                  AbstractFunctionValue* function = r[instruction.a + num_args].getPointer<AbstractFunctionValue>();
+                  // Registers from a on are dead temporaries, so the callee's frame
+                  // starts at the arguments and overlays them
+                  Value* arguments = r + instruction.a;
+                  stack_top = arguments + num_args;
+                  Value result = function->call(arguments, num_args);
+                  stack_top = frame_end;
+                  // The callee left its own values there, which the collector must not see
+                  for (Value* v = arguments + 1; v < frame_end; v++) {
+                      *v = Value::makeNone();
+                  }
+                  r[instruction.a] = result;
+              }
+              break;
+
+              case RegisterOperation::Return:
+                  return r[instruction.a];
+
+              case RegisterOperation::Add:
+                  r[instruction.a] = add(r[instruction.b], r[instruction.c]);
+              break;
+
+              case RegisterOperation::Sub:
+                  r[instruction.a] = Value::makeInteger(r[instruction.b].getInteger() - r[instruction.c].getInteger());
+              break;
+
+              case RegisterOperation::Mul:
+                  r[instruction.a] = Value::makeInteger(r[instruction.b].getInteger() * r[instruction.c].getInteger());
+              break;
+
+              case RegisterOperation::Div: {
+                  if (r[instruction.c].getInteger() == 0) {
+                      throw IllegalArithmeticException("divide by zero");
+                  }
+                  r[instruction.a] = Value::makeInteger(r[instruction.b].getInteger() / r[instruction.c].getInteger());
+              }
+              break;
+
+              case RegisterOperation::Gt:
+                  r[instruction.a] = Value::makeBoolean(r[instruction.b].getInteger() > r[instruction.c].getInteger());
+              break;
+
+              case RegisterOperation::Geq:
+                  r[instruction.a] = Value::makeBoolean(r[instruction.b].getInteger() >= r[instruction.c].getInteger());
+              break;
+
+              case RegisterOperation::Eq:
+                  r[instruction.a] = equals(r[instruction.b], r[instruction.c]);
+              break;
+
+              case RegisterOperation::And:
+                  r[instruction.a] = Value::makeBoolean(r[instruction.b].getBoolean() && r[instruction.c].getBoolean());
+              break;
+
+              case RegisterOperation::Or:
+                  r[instruction.a] = Value::makeBoolean(r[instruction.b].getBoolean() || r[instruction.c].getBoolean());
+              break;
+
+              case RegisterOperation::Neg:
+                  r[instruction.a] = Value::makeInteger(-r[instruction.b].getInteger());
+              break;
+
+              case RegisterOperation::Not:
+                  r[instruction.a] = Value::makeBoolean(!r[instruction.b].getBoolean());
+              break;
+
+              case RegisterOperation::Goto:
+                  ip = instruction.a;
+              break;
+
+              case RegisterOperation::If:
+                  if (r[instruction.b].getBoolean()) {
+                      ip = instruction.a;
+                  }
+              break;
+
+              case RegisterOperation::GarbageCollect:
+                  potentially_garbage_collect();
+              break;
+
+              case RegisterOperation::ThrowUninitialized:
+                  throw UninitializedVariableException(func.names_[instruction.a]);
+
+              default:
+                  throw RuntimeException("Found an unknown opcode.");
+          }
+      }
+      return Value::makeNone();
+  }
+}
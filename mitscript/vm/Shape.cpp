@@ -0,0 +1,36 @@
+#include "Shape.h"
+
+namespace VM {
+  Shape::Shape(Shape* parent, BC::Atom key) : parent(parent), key(key) {
+    if (parent == nullptr) {
+      field_count = 0;
+    } else {
+      slots = parent->slots;
+      slots[key] = parent->field_count;
+      field_count = parent->field_count + 1;
+    }
+  }
+
+  Shape* Shape::root() {
+    static Shape* empty = new Shape(nullptr, BC::Atom());
+    return empty;
+  }
+
+  Shape* Shape::add(BC::Atom key) {
+    auto it = transitions.find(key);
+    if (it != transitions.end()) {
+      return it->second;
+    }
+    Shape* shape = new Shape(this, key);
+    transitions[key] = shape;
+    return shape;
+  }
+
+  int64_t Shape::lookup(BC::Atom key) const {
+    auto it = slots.find(key);
+    if (it == slots.end()) {
+      return -1;
+    }
+    return it->second;
+  }
+}
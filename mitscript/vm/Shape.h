@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <unordered_map>
+#include "../bccompiler/Atom.h"
+
+// Number of fields a record stores inside the object itself, the rest go to its overflow vector
+#define RECORD_INLINE_SLOTS 4
+// Records with more fields than this leave the shape tree and become plain dictionaries
+#define SHAPE_MAX_FIELDS 64
+
+namespace VM {
+  // The layout of a record: the names of its fields in insertion order, and
+  // the slot each one is stored in. Shapes form a tree rooted at the empty
+  // shape; adding a field follows (or creates) a transition, so records built
+  // by the same code share a shape, and a field access site only has to
+  // compare shapes to know where the field is.
+  //
+  // Shapes are shared by all records and are never freed.
+  struct Shape {
+    Shape* parent;
+    BC::Atom key;
+    uint32_t field_count;
+    std::unordered_map<BC::Atom, uint32_t> slots;
+    std::unordered_map<BC::Atom, Shape*> transitions;
+
+    static Shape* root();
+
+    // The shape reached by adding key to this one, whose slot is field_count
+    Shape* add(BC::Atom key);
+
+    // Slot of key, or -1 when this shape has no such field
+    int64_t lookup(BC::Atom key) const;
+
+  private:
+    Shape(Shape* parent, BC::Atom key);
+  };
+}
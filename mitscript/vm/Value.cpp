@@ -1,8 +1,12 @@
 #include "Value.h"
 #include "Interpreter.h"
 #include "globals.h"
+#include "operations.h"
+#include "output.h"
+#include "input.h"
 #include "../ir/OptimizingCompiler.h"
 #include "../asm/Compiler.h"
+#include "RegisterCompiler.h"
 #include <list>
 #include <stdlib.h> 
 
@@ -22,6 +26,9 @@ namespace VM {
       case _STRING_CONSTANT_TAG: {
         return std::string(getStringConstant());
       }
+      case _SMALL_STRING_TAG: {
+        return std::string(reinterpret_cast<const char*>(&value) + 1, getSmallStringLength());
+      }
       case _STRING_VALUE_TAG:
       case _POINTER_TAG: {
         return getPointerValue()->toString();
@@ -29,17 +36,54 @@ namespace VM {
     }
   }
 
-  StringValue::StringValue(GC::CollectedHeap& heap, const std::string& value) : PointerValue(heap) {
+  void Value::write(CharSink& sink) const {
+    switch (value & _VALUE_MASK) {
+      case _INTEGER_TAG: {
+        char digits[24];
+        sink.append(digits, snprintf(digits, sizeof(digits), "%ld", static_cast<long>(getInteger())));
+        break;
+      }
+      case _STRING_CONSTANT_TAG: {
+        const char* chars = getStringConstant();
+        sink.append(chars, strlen(chars));
+        break;
+      }
+      case _SMALL_STRING_TAG: {
+        sink.append(reinterpret_cast<const char*>(&value) + 1, getSmallStringLength());
+        break;
+      }
+      case _STRING_VALUE_TAG:
+      case _POINTER_TAG: {
+        getPointerValue()->write(sink);
+        break;
+      }
+      default: {
+        sink.append(toString());
+      }
+    }
+  }
+
+  struct StringSink : CharSink {
+    std::string chars;
+
+    void append(const char* more, size_t length) {
+      chars.append(more, length);
+    }
+  };
+
+  StringValue::StringValue(GC::CollectedHeap& heap, const std::string& value) : StringValue(heap, value.data(), value.size()) {}
+
+  StringValue::StringValue(GC::CollectedHeap& heap, const char* chars, size_t length) : PointerValue(heap, PointerKind::String) {
     height = 0;
-    length = value.size();
+    this->length = length;
     if (length > 0) {
       memory = static_cast<char*>(malloc(length * sizeof(char)));
-      strncpy(memory, value.c_str(), length);
+      memcpy(memory, chars, length);
     }
     heap.increaseSize(size());
   }
 
-  StringValue::StringValue(GC::CollectedHeap& heap, const Value l, const Value r) : PointerValue(heap) {
+  StringValue::StringValue(GC::CollectedHeap& heap, const Value l, const Value r) : PointerValue(heap, PointerKind::String) {
     if (l.isPointer() && !l.isStringValue()) {
       // Must be a record or function
       left = Value::makeString(heap.allocate<StringValue>(l.toString()));
@@ -53,6 +97,7 @@ namespace VM {
       right = r;
     }
     height = 1;
+    length = left.stringLength() + right.stringLength();
     if (left.isPointer()) {
       // Must be a string now
       StringValue* ll = left.getPointer<StringValue>();
@@ -62,6 +107,7 @@ namespace VM {
       StringValue* rr = right.getPointer<StringValue>();
       height = max(height, rr->height + 1);
     }
+    heap.increaseSize(size());
   }
 
   StringValue::~StringValue() {
@@ -75,10 +121,10 @@ namespace VM {
   }
 
   std::string StringValue::toString() {
-    if (height == 0) {
-      return std::string(memory, length);
+    if (height > 0) {
+      flatten();
     }
-    return left.toString() + right.toString();
+    return std::string(memory, length);
   };
 
   size_t StringValue::size() {
@@ -89,17 +135,232 @@ namespace VM {
     }
   }
 
-  void StringValue::markChildren(uint32_t generation, bool mark_recent_only) {
+  void StringValue::markChildren() {
     if (height == 0) return;
     if (left.isPointer()) {
-      left.getPointerValue()->mark(generation, mark_recent_only);
+      heap.mark(left.getPointerValue());
     }
     if (right.isPointer()) {
-      right.getPointerValue()->mark(generation, mark_recent_only);
+      heap.mark(right.getPointerValue());
+    }
+  }
+
+  void StringValue::evacuateChildren() {
+    if (height == 0) return;
+    heap.evacuate(left.value);
+    heap.evacuate(right.value);
+  }
+
+  bool StringChunks::next(const char*& chunk, size_t& length) {
+    while (!pending.empty()) {
+      Value value = pending.back();
+      pending.pop_back();
+      if (value.isStringValue()) {
+        StringValue* string = value.getPointer<StringValue>();
+        if (string->height > 0) {
+          pending.push_back(string->right);
+          pending.push_back(string->left);
+          continue;
+        }
+        chunk = string->memory;
+        length = string->length;
+      } else if (value.isSmallString()) {
+        length = value.getSmallStringLength();
+        memcpy(scratch, reinterpret_cast<const char*>(&value.value) + 1, length);
+        chunk = scratch;
+      } else if (value.isString()) {
+        chunk = value.getStringConstant();
+        length = strlen(chunk);
+      } else if (value.isInteger()) {
+        length = snprintf(scratch, sizeof(scratch), "%ld", static_cast<long>(value.getInteger()));
+        chunk = scratch;
+      } else {
+        // None and booleans, as records and functions never end up in a tree
+        std::string text = value.toString();
+        length = text.copy(scratch, sizeof(scratch));
+        chunk = scratch;
+      }
+      if (length > 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void StringValue::write(CharSink& sink) {
+    StringChunks chunks(Value::makeString(this));
+    const char* chunk;
+    size_t chunk_length;
+    while (chunks.next(chunk, chunk_length)) {
+      sink.append(chunk, chunk_length);
+    }
+  }
+
+  void StringValue::flatten() {
+    char* flat = length > 0 ? static_cast<char*>(malloc(length * sizeof(char))) : nullptr;
+    size_t offset = 0;
+    StringChunks chunks(Value::makeString(this));
+    const char* chunk;
+    size_t chunk_length;
+    while (chunks.next(chunk, chunk_length)) {
+      memcpy(flat + offset, chunk, chunk_length);
+      offset += chunk_length;
+    }
+    memory = flat;
+    height = 0;
+    left = Value::makeNone();
+    right = Value::makeNone();
+    heap.increaseSize(length * sizeof(char));
+  }
+
+  static size_t rope_height(Value value) {
+    return value.isStringValue() ? value.getPointer<StringValue>()->height : 0;
+  }
+
+  static Value rope_node(GC::CollectedHeap& heap, Value left, Value right) {
+    return Value::makeString(heap.allocate<StringValue>(left, right));
+  }
+
+  // Joins two balanced trees where left is more than one level taller, the
+  // way AVL trees are joined: right goes down left's right spine to where
+  // the heights match, and a single or double rotation restores the balance
+  // on the way back up. New nodes are made along that path only
+  static Value join_right(GC::CollectedHeap& heap, Value left, Value right) {
+    StringValue* tall = left.getPointer<StringValue>();
+    Value outer = tall->left;
+    Value inner = tall->right;
+    Value joined = rope_height(inner) > rope_height(right) + 1
+      ? join_right(heap, inner, right)
+      : StringValue::concat(heap, inner, right);
+    if (rope_height(joined) <= rope_height(outer) + 1) {
+      return rope_node(heap, outer, joined);
+    }
+    StringValue* top = joined.getPointer<StringValue>();
+    if (rope_height(top->left) > rope_height(top->right)) {
+      StringValue* middle = top->left.getPointer<StringValue>();
+      return rope_node(heap, rope_node(heap, outer, middle->left), rope_node(heap, middle->right, top->right));
     }
+    return rope_node(heap, rope_node(heap, outer, top->left), top->right);
   }
 
-  RecordValue::RecordValue(GC::CollectedHeap& heap) : PointerValue(heap) {
+  // The mirror image of join_right, for a right tree more than one level taller
+  static Value join_left(GC::CollectedHeap& heap, Value left, Value right) {
+    StringValue* tall = right.getPointer<StringValue>();
+    Value inner = tall->left;
+    Value outer = tall->right;
+    Value joined = rope_height(inner) > rope_height(left) + 1
+      ? join_left(heap, left, inner)
+      : StringValue::concat(heap, left, inner);
+    if (rope_height(joined) <= rope_height(outer) + 1) {
+      return rope_node(heap, joined, outer);
+    }
+    StringValue* top = joined.getPointer<StringValue>();
+    if (rope_height(top->right) > rope_height(top->left)) {
+      StringValue* middle = top->right.getPointer<StringValue>();
+      return rope_node(heap, rope_node(heap, top->left, middle->left), rope_node(heap, middle->right, outer));
+    }
+    return rope_node(heap, top->left, rope_node(heap, top->right, outer));
+  }
+
+  Value StringValue::concat(GC::CollectedHeap& heap, Value left, Value right) {
+    if (left.isPointer() && !left.isStringValue()) {
+      // Must be a record or function
+      left = Value::makeString(heap.allocate<StringValue>(left.toString()));
+    }
+    if (right.isPointer() && !right.isStringValue()) {
+      right = Value::makeString(heap.allocate<StringValue>(right.toString()));
+    }
+    if (left.stringLength() + right.stringLength() <= ROPE_FLAT_MAX) {
+      return make_string(left.toString() + right.toString());
+    }
+    size_t left_height = rope_height(left);
+    size_t right_height = rope_height(right);
+    if (left_height > right_height + 1) {
+      return join_right(heap, left, right);
+    } else if (right_height > left_height + 1) {
+      return join_left(heap, left, right);
+    }
+    return rope_node(heap, left, right);
+  }
+
+  size_t StringValue::hash() {
+    if (!hashed) {
+      // FNV-1a, which can be fed one chunk at a time
+      size_t h = 14695981039346656037ULL;
+      StringChunks chunks(Value::makeString(this));
+      const char* chunk;
+      size_t chunk_length;
+      while (chunks.next(chunk, chunk_length)) {
+        for (size_t i = 0; i < chunk_length; i++) {
+          h = (h ^ static_cast<unsigned char>(chunk[i])) * 1099511628211ULL;
+        }
+      }
+      hash_code = h;
+      hashed = true;
+    }
+    return hash_code;
+  }
+
+  size_t Value::stringLength() const {
+    if (__IS_SMALL_STRING_VALUE(value)) {
+      return getSmallStringLength();
+    } else if (__IS_STRING_VALUE(value)) {
+      return getPointer<StringValue>()->length;
+    } else if (__IS_STRING_CONSTANT_VALUE(value)) {
+      return strlen(getStringConstant());
+    }
+    return toString().length();
+  }
+
+  bool Value::stringEquals(Value other) const {
+    // Constants are interned, so two different ones differ
+    if (__IS_STRING_CONSTANT_VALUE(value) && __IS_STRING_CONSTANT_VALUE(other.value)) {
+      return false;
+    }
+    if (__IS_SMALL_STRING_VALUE(value) && __IS_SMALL_STRING_VALUE(other.value)) {
+      return false;
+    }
+    if (stringLength() != other.stringLength()) {
+      return false;
+    }
+    if (__IS_STRING_VALUE(value) && __IS_STRING_VALUE(other.value) &&
+        getPointer<StringValue>()->hash() != other.getPointer<StringValue>()->hash()) {
+      return false;
+    }
+    StringChunks mine(*this), theirs(other);
+    const char* my_chunk;
+    const char* their_chunk;
+    size_t my_length = 0, their_length = 0;
+    // The lengths are equal, so both run out together
+    while (true) {
+      if (my_length == 0 && !mine.next(my_chunk, my_length)) {
+        return true;
+      }
+      if (their_length == 0) {
+        theirs.next(their_chunk, their_length);
+      }
+      size_t n = min(my_length, their_length);
+      if (memcmp(my_chunk, their_chunk, n) != 0) {
+        return false;
+      }
+      my_chunk += n;
+      their_chunk += n;
+      my_length -= n;
+      their_length -= n;
+    }
+  }
+
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Winvalid-offsetof"
+  const int32_t PointerValue::kind_offset = offsetof(PointerValue, kind);
+  const int32_t BuiltInFunctionValue::type_offset = offsetof(BuiltInFunctionValue, type);
+  const int32_t RecordValue::shape_offset = offsetof(RecordValue, shape);
+  const int32_t RecordValue::slots_offset = offsetof(RecordValue, slots);
+  const int32_t RecordValue::elements_offset = offsetof(RecordValue, elements);
+  const int32_t RecordValue::element_count_offset = offsetof(RecordValue, element_count);
+  #pragma GCC diagnostic pop
+
+  RecordValue::RecordValue(GC::CollectedHeap& heap) : PointerValue(heap, PointerKind::Record), shape(Shape::root()) {
     heap.increaseSize(size());
   }
 
@@ -108,50 +369,342 @@ namespace VM {
     cout << "DELETING RecordValue: " << toString() << endl;
     #endif
     heap.decreaseSize(size());
+    free(elements);
   }
 
-  Value RecordValue::get(std::string key) {
-    return values[key];
+  // Whether key is how a non-negative integer prints, so that a["3"] and a[3] are the same element
+  static bool parse_index(const std::string& key, size_t& index) {
+    if (key.empty() || key.size() > 19 || (key[0] == '0' && key.size() > 1)) {
+      return false;
+    }
+    size_t result = 0;
+    for (char c : key) {
+      if (c < '0' || c > '9') {
+        return false;
+      }
+      result = result * 10 + (c - '0');
+    }
+    index = result;
+    return true;
   }
 
-  void RecordValue::insert(std::string key, Value inserted) {
-    if (values.count(key) == 0)
-      heap.increaseSize(sizeof(std::string) + key.capacity() * sizeof(char) + sizeof(Value));
-    values[key] = inserted;
+  Value& RecordValue::slot(uint32_t index) {
+    if (index < RECORD_INLINE_SLOTS) {
+      return slots[index];
+    }
+    return overflow[index - RECORD_INLINE_SLOTS];
+  }
+
+  void RecordValue::add_field(Shape* next, Value inserted) {
+    if (next->field_count > RECORD_INLINE_SLOTS) {
+      overflow.push_back(inserted);
+      heap.increaseSize(sizeof(Value));
+    } else {
+      slots[next->field_count - 1] = inserted;
+    }
+    shape = next;
+  }
+
+  void RecordValue::make_dictionary() {
+    dictionary.reset(new std::unordered_map<BC::Atom, Value>());
+    std::vector<Shape*> chain;
+    for (Shape* s = shape; s->parent != nullptr; s = s->parent) {
+      chain.push_back(s);
+    }
+    for (auto it = chain.rbegin(); it != chain.rend(); it++) {
+      Shape* s = *it;
+      (*dictionary)[s->key] = slot(s->field_count - 1);
+      heap.increaseSize(sizeof(BC::Atom) + sizeof(Value));
+    }
+    heap.decreaseSize(overflow.size() * sizeof(Value));
+    overflow.clear();
+    overflow.shrink_to_fit();
+    shape = nullptr;
+  }
+
+  void RecordValue::write_barrier(Value inserted) {
     if (has_optimization(OPTIMIZATION_GC_GENERATIONAL) &&
         inserted.isPointer() &&
         !inserted.getPointerValue()->is_old &&
         this->is_old) {
-      heap.cross_generation_pointers.push_back(&(values[key].value));
+      GC::CollectedHeap::remember(this);
+    }
+  }
+
+  Value RecordValue::get_element(size_t index) {
+    if (index < element_count) {
+      return elements[index];
+    }
+    if (sparse_elements) {
+      auto it = sparse_elements->find(index);
+      if (it != sparse_elements->end()) {
+        return it->second;
+      }
+    }
+    return Value::makeNone();
+  }
+
+  void RecordValue::append_element(Value inserted) {
+    if (element_count == element_capacity) {
+      element_capacity = element_capacity == 0 ? RECORD_INLINE_SLOTS : element_capacity * 2;
+      elements = static_cast<Value*>(realloc(elements, element_capacity * sizeof(Value)));
+    }
+    elements[element_count++] = inserted;
+  }
+
+  void RecordValue::insert_element(size_t index, Value inserted) {
+    write_barrier(inserted);
+    if (index < element_count) {
+      elements[index] = inserted;
+      return;
+    }
+    if (index > element_count) {
+      if (!sparse_elements) {
+        sparse_elements.reset(new std::unordered_map<size_t, Value>());
+      }
+      if (sparse_elements->count(index) == 0)
+        heap.increaseSize(sizeof(size_t) + sizeof(Value));
+      (*sparse_elements)[index] = inserted;
+      return;
+    }
+    append_element(inserted);
+    heap.increaseSize(sizeof(Value));
+    // Filling the gap before sparse keys (like an array built back to front) makes them dense again
+    if (sparse_elements) {
+      auto it = sparse_elements->find(element_count);
+      while (it != sparse_elements->end()) {
+        append_element(it->second);
+        sparse_elements->erase(it);
+        heap.decreaseSize(sizeof(size_t));
+        it = sparse_elements->find(element_count);
+      }
+    }
+  }
+
+  Value RecordValue::get(Value index) {
+    if (index.isInteger() && index.getInteger() >= 0) {
+      return get_element(index.getInteger());
+    }
+    return get(index.toString());
+  }
+
+  void RecordValue::insert(Value index, Value inserted) {
+    if (index.isInteger() && index.getInteger() >= 0) {
+      insert_element(index.getInteger(), inserted);
+      return;
+    }
+    insert(index.toString(), inserted);
+  }
+
+  // Keys that were never interned can't be in any record, so reads don't intern them
+  Value RecordValue::get(const std::string& key) {
+    size_t element;
+    if (parse_index(key, element)) {
+      return get_element(element);
+    }
+    BC::Atom atom;
+    if (!BC::Atom::find(key, atom)) {
+      return Value::makeNone();
+    }
+    return get_field(atom);
+  }
+
+  void RecordValue::insert(const std::string& key, Value inserted) {
+    size_t element;
+    if (parse_index(key, element)) {
+      insert_element(element, inserted);
+      return;
+    }
+    insert_field(BC::Atom(key), inserted);
+  }
+
+  Value RecordValue::get_field(BC::Atom key) {
+    if (shape == nullptr) {
+      auto it = dictionary->find(key);
+      if (it == dictionary->end()) {
+        return Value::makeNone();
+      }
+      return it->second;
+    }
+    int64_t index = shape->lookup(key);
+    if (index < 0) {
+      return Value::makeNone();
+    }
+    return slot(index);
+  }
+
+  void RecordValue::insert_field(BC::Atom key, Value inserted) {
+    write_barrier(inserted);
+    if (shape != nullptr) {
+      int64_t index = shape->lookup(key);
+      if (index >= 0) {
+        slot(index) = inserted;
+        return;
+      }
+      if (shape->field_count < SHAPE_MAX_FIELDS) {
+        add_field(shape->add(key), inserted);
+        return;
+      }
+      make_dictionary();
+    }
+    if (dictionary->count(key) == 0)
+      heap.increaseSize(sizeof(BC::Atom) + sizeof(Value));
+    (*dictionary)[key] = inserted;
+  }
+
+  Value RecordValue::get(BC::FieldCache& cache) {
+    if (shape == nullptr) {
+      return get_field(cache.name);
+    }
+    for (size_t i = 0; i < FIELD_CACHE_SIZE; i++) {
+      // -1 has the transition bit set too, but absent fields are loads
+      if (cache.shapes[i] == shape && (cache.slots[i] < 0 || !(cache.slots[i] & FIELD_CACHE_TRANSITION))) {
+        return cache.slots[i] < 0 ? Value::makeNone() : slot(cache.slots[i]);
+      }
+    }
+    int64_t index = shape->lookup(cache.name);
+    size_t entry = cache.next++ % FIELD_CACHE_SIZE;
+    cache.shapes[entry] = shape;
+    cache.slots[entry] = index;
+    cache.transitions[entry] = nullptr;
+    return index < 0 ? Value::makeNone() : slot(index);
+  }
+
+  void RecordValue::insert(BC::FieldCache& cache, Value inserted) {
+    if (shape == nullptr) {
+      insert_field(cache.name, inserted);
+      return;
+    }
+    for (size_t i = 0; i < FIELD_CACHE_SIZE; i++) {
+      if (cache.shapes[i] != shape || cache.slots[i] < 0) {
+        continue;
+      }
+      write_barrier(inserted);
+      if (cache.slots[i] & FIELD_CACHE_TRANSITION) {
+        add_field(cache.transitions[i], inserted);
+      } else {
+        slot(cache.slots[i]) = inserted;
+      }
+      return;
+    }
+    Shape* before = shape;
+    int64_t index = before->lookup(cache.name);
+    insert_field(cache.name, inserted);
+    if (shape == nullptr) {
+      return;
+    }
+    size_t entry = cache.next++ % FIELD_CACHE_SIZE;
+    cache.shapes[entry] = before;
+    if (index >= 0) {
+      cache.slots[entry] = index;
+      cache.transitions[entry] = nullptr;
+    } else {
+      cache.slots[entry] = FIELD_CACHE_TRANSITION | (shape->field_count - 1);
+      cache.transitions[entry] = shape;
     }
   }
 
   std::string RecordValue::toString() {
-    std::string result = "{";
-    for (auto keyvalue : values) {
-        result += keyvalue.first + ":" + keyvalue.second.toString() + " ";
-    };
-    result += "}";
-    return result;
+    StringSink sink;
+    write(sink);
+    return sink.chars;
+  }
+
+  void RecordValue::write(CharSink& sink) {
+    sink.append("{", 1);
+    for (size_t i = 0; i < element_count; i++) {
+      Value::makeInteger(i).write(sink);
+      sink.append(":", 1);
+      elements[i].write(sink);
+      sink.append(" ", 1);
+    }
+    if (sparse_elements) {
+      for (auto keyvalue : *sparse_elements) {
+        Value::makeInteger(keyvalue.first).write(sink);
+        sink.append(":", 1);
+        keyvalue.second.write(sink);
+        sink.append(" ", 1);
+      }
+    }
+    if (shape == nullptr) {
+      for (auto keyvalue : *dictionary) {
+        sink.append(keyvalue.first.str());
+        sink.append(":", 1);
+        keyvalue.second.write(sink);
+        sink.append(" ", 1);
+      }
+    } else {
+      for (Shape* s = shape; s->parent != nullptr; s = s->parent) {
+        sink.append(s->key.str());
+        sink.append(":", 1);
+        slot(s->field_count - 1).write(sink);
+        sink.append(" ", 1);
+      }
+    }
+    sink.append("}", 1);
   }
 
   size_t RecordValue::size() {
-    size_t s = sizeof(RecordValue);
-    for (auto pair : values) {
-      s += sizeof(std::string) + pair.first.capacity() * sizeof(char) + sizeof(Value);
+    size_t s = sizeof(RecordValue) + (overflow.size() + element_count) * sizeof(Value);
+    if (sparse_elements) {
+      s += sparse_elements->size() * (sizeof(size_t) + sizeof(Value));
+    }
+    if (dictionary) {
+      s += dictionary->size() * (sizeof(BC::Atom) + sizeof(Value));
     }
     return s;
   }
 
-  void RecordValue::markChildren(uint32_t generation, bool mark_recent_only) {
-    for (auto& pair : values) {
-      if (pair.second.isPointer()) {
-        pair.second.getPointerValue()->mark(generation, mark_recent_only);
+  void RecordValue::markChildren() {
+    for (size_t i = 0; i < element_count; i++) {
+      if (elements[i].isPointer()) {
+        heap.mark(elements[i].getPointerValue());
+      }
+    }
+    if (sparse_elements) {
+      for (auto& pair : *sparse_elements) {
+        if (pair.second.isPointer()) {
+          heap.mark(pair.second.getPointerValue());
+        }
+      }
+    }
+    if (shape == nullptr) {
+      for (auto& pair : *dictionary) {
+        if (pair.second.isPointer()) {
+          heap.mark(pair.second.getPointerValue());
+        }
       }
+      return;
+    }
+    for (uint32_t i = 0; i < shape->field_count; i++) {
+      Value& value = slot(i);
+      if (value.isPointer()) {
+        heap.mark(value.getPointerValue());
+      }
+    }
+  }
+
+  void RecordValue::evacuateChildren() {
+    for (size_t i = 0; i < element_count; i++) {
+      heap.evacuate(elements[i].value);
+    }
+    if (sparse_elements) {
+      for (auto& pair : *sparse_elements) {
+        heap.evacuate(pair.second.value);
+      }
+    }
+    if (shape == nullptr) {
+      for (auto& pair : *dictionary) {
+        heap.evacuate(pair.second.value);
+      }
+      return;
+    }
+    for (uint32_t i = 0; i < shape->field_count; i++) {
+      heap.evacuate(slot(i).value);
     }
   }
 
-  ReferenceValue::ReferenceValue(GC::CollectedHeap& heap, Value v) : PointerValue(heap), value(v) {
+  ReferenceValue::ReferenceValue(GC::CollectedHeap& heap, Value v) : PointerValue(heap, PointerKind::Reference), value(v) {
     heap.increaseSize(size());
   }
 
@@ -176,7 +729,7 @@ namespace VM {
         v.isPointer() &&
         !v.getPointerValue()->is_old &&
         this->is_old) {
-      interpreter->heap.cross_generation_pointers.push_back(&(value.value));
+      GC::CollectedHeap::remember(this);
     }
   }
 
@@ -184,17 +737,21 @@ namespace VM {
     return sizeof(ReferenceValue);
   }
 
-  void ReferenceValue::markChildren(uint32_t generation, bool mark_recent_only) {
+  void ReferenceValue::markChildren() {
     if (value.isPointer()) {
-      value.getPointerValue()->mark(generation, mark_recent_only);
+      heap.mark(value.getPointerValue());
     }
   }
 
+  void ReferenceValue::evacuateChildren() {
+    heap.evacuate(value.value);
+  }
+
   std::string AbstractFunctionValue::toString() {
     return "FUNCTION";
   }
 
-  BareFunctionValue::BareFunctionValue(GC::CollectedHeap& heap, std::shared_ptr<BC::Function> value) : AbstractFunctionValue(heap), value(value) {
+  BareFunctionValue::BareFunctionValue(GC::CollectedHeap& heap, std::shared_ptr<BC::Function> value) : AbstractFunctionValue(heap, PointerKind::BareFunction), value(value) {
       heap.increaseSize(size());
     }
 
@@ -205,11 +762,11 @@ namespace VM {
     heap.decreaseSize(size());
   }
 
-  Value BareFunctionValue::call(std::vector<Value> & arguments) {
+  Value BareFunctionValue::call(Value* arguments, size_t argc) {
     throw RuntimeException("call on a BareFunctionValue");
   }
 
-  ClosureFunctionValue::ClosureFunctionValue(GC::CollectedHeap& heap, std::shared_ptr<BC::Function> value) : AbstractFunctionValue(heap), value(value) {
+  ClosureFunctionValue::ClosureFunctionValue(GC::CollectedHeap& heap, std::shared_ptr<BC::Function> value) : AbstractFunctionValue(heap, PointerKind::ClosureFunction), value(value) {
     heap.increaseSize(size());
   }
 
@@ -230,97 +787,128 @@ namespace VM {
     return sizeof(ClosureFunctionValue) + value->free_vars_.size() * sizeof(ReferenceValue*);
   }
 
-  void ClosureFunctionValue::markChildren(uint32_t generation, bool mark_recent_only) {
+  void ClosureFunctionValue::markChildren() {
     for (auto ref : references) {
-      ref->mark(generation, mark_recent_only);
+      heap.mark(ref);
     }
   }
 
-  Value ClosureFunctionValue::call(std::vector<Value> & arguments) {
-    if (value->parameter_count_ != arguments.size()) {
+  void ClosureFunctionValue::evacuateChildren() {
+    for (auto& ref : references) {
+      heap.evacuate(ref);
+    }
+  }
+
+  // The frame of a call is carved out of the VM stack as
+  //   [locals | references | closure | temporaries or operand area]
+  // where the first locals are the arguments. Interpreted and compiled code
+  // get pointers into the same layout. The closure slot keeps the running
+  // closure alive even if nothing else refers to it anymore.
+  Value ClosureFunctionValue::call(Value* arguments, size_t argc) {
+    if (value->parameter_count_ != argc) {
         throw RuntimeException("An incorrect number of parameters was passed to the function");
     }
 
-    int num_references = value->local_reference_vars_.size() + value->free_vars_.size();
-    Value local_vars[value->local_vars_.size()];
-    ReferenceValue* local_reference_vars[num_references];
+    if (has_optimization(OPTIMIZATION_MACHINE_CODE) && !value->is_compiled) {
+      InstructionList ir;
+      IR::OptimizingCompiler ir_compiler(value, ir);
+      size_t temp_count = ir_compiler.compile(has_optimization(OPTIMIZATION_OPTIMIZATION_PASSES));
+      ASM::Compiler asm_compiler(ir, temp_count);
+      asm_compiler.compileInto(value->compiled_function);
+      value->is_compiled = !has_optimization(OPTIMIZATION_COMPILE_ONLY);
+    }
 
-    for (int i = 0; i < value->local_vars_.size(); i++) {
-      local_vars[i] = Value::makeNone();
+    // The register VM keeps its temporaries in the same frame, right after the closure
+    bool use_registers = !value->is_compiled && has_optimization(OPTIMIZATION_REGISTER_VM);
+    if (use_registers && !value->is_register_compiled) {
+      RegisterCompiler(*value).compile();
+    }
+    size_t local_count = value->local_vars_.size();
+    size_t num_references = value->local_reference_vars_.size() + value->free_vars_.size();
+    size_t header_size = local_count + num_references + 1;
+    size_t frame_size = use_registers ? value->register_count : header_size;
+
+    Value* saved_top = interpreter->stack_top;
+    Value* local_vars = arguments + argc == saved_top ? arguments : saved_top;
+    if (local_vars + frame_size > interpreter->stack_limit) {
+      throw RuntimeException("Ran out of space on the stack!");
     }
+    ReferenceValue** local_reference_vars = reinterpret_cast<ReferenceValue**>(local_vars + local_count);
 
-    for (int i = 0; i < value->local_reference_vars_.size(); i++) {
+    for (size_t i = 0; i < value->local_reference_vars_.size(); i++) {
       local_reference_vars[i] = heap.allocate<ReferenceValue>(Value::makeNone());
     }
-    for (int i = 0; i < value->free_vars_.size(); i++) {
+    for (size_t i = 0; i < value->free_vars_.size(); i++) {
       local_reference_vars[value->local_reference_vars_.size() + i] = references[i];
     }
 
-    for (int i = 0; i < arguments.size(); i++) {
+    for (size_t i = 0; i < argc; i++) {
       if (value->arg_mapping[i] == -1) {
         local_vars[i] = arguments[i];
       } else {
         local_reference_vars[value->arg_mapping[i]]->write(arguments[i]);
+        local_vars[i] = Value::makeNone();
       }
     }
-
-    if (has_optimization(OPTIMIZATION_MACHINE_CODE) && !value->is_compiled) {
-      InstructionList ir;
-      IR::OptimizingCompiler ir_compiler(value, ir);
-      size_t temp_count = ir_compiler.compile(has_optimization(OPTIMIZATION_OPTIMIZATION_PASSES));
-      ASM::Compiler asm_compiler(ir, temp_count);
-      asm_compiler.compileInto(value->compiled_function);
-      value->is_compiled = !has_optimization(OPTIMIZATION_COMPILE_ONLY);
+    for (size_t i = argc; i < local_count; i++) {
+      local_vars[i] = Value::makeNone();
+    }
+    local_vars[header_size - 1] = Value::makePointer(this);
+    for (size_t i = header_size; i < frame_size; i++) {
+      local_vars[i] = Value::makeNone();
     }
 
-    interpreter->push_frame(&local_vars[0], value->local_vars_.size(), &local_reference_vars[0], num_references);
+    interpreter->stack_top = local_vars + frame_size;
+    interpreter->push_frame(local_reference_vars, num_references);
 
     Value result;
     if (value->is_compiled) {
-      result = Value(value->compiled_function.call<uint64_t, void*, void*, void*>(this, &local_vars[0], &local_reference_vars[0]));
+      result = Value(value->compiled_function.call<uint64_t, void*, void*, void*>(this, local_vars, local_reference_vars));
+    } else if (use_registers) {
+      result = interpreter->run_register_function(this, local_vars, local_reference_vars);
     } else {
-      result = interpreter->run_function(this, &local_vars[0], &local_reference_vars[0]);
+      result = interpreter->run_function(this, local_vars, local_reference_vars);
     }
 
     interpreter->pop_frame();
+    interpreter->stack_top = saved_top;
 
     return result;
   }
 
-  Value BuiltInFunctionValue::call(std::vector<Value> & arguments) {
+  Value BuiltInFunctionValue::call(Value* arguments, size_t argc) {
     switch (type) {
         case BuiltInFunctionType::Print: {
-          if (arguments.size() != 1) {
+          if (argc != 1) {
             throw RuntimeException("Wrong number of arguments to print");
           }
           #if DEBUG
-          std::cout << "===== ";
+          output.append("===== ", 6);
           #endif
           if (!has_option(OPTION_SHOW_MEMORY_TRACE)) {
-            std::cout << arguments[0].toString() << std::endl;
+            output.print(arguments[0]);
           }
           return Value::makeNone();
         }
         break;
 
         case BuiltInFunctionType::Input: {
-          if (arguments.size() != 0) {
+          if (argc != 0) {
             throw RuntimeException("Wrong number of arguments to input");
           }
-          std::string input;
-          std::cin >> input;
-          return Value::makeString(heap.allocate<StringValue>(input));
+          output.input_requested();
+          const char* word;
+          size_t length;
+          input.next_word(word, length);
+          return make_string(word, length);
         }
         break;
 
         case BuiltInFunctionType::Intcast: {
-          if (arguments.size() != 1) {
+          if (argc != 1) {
             throw RuntimeException("Wrong number of arguments to intcast");
           }
-          if (!arguments[0].isString()) {
-            throw IllegalCastException("A string wasn't passed to intcast");
-          }
-          return Value::makeInteger(atoi(arguments[0].toString().c_str()));
+          return intcast(arguments[0]);
         }
         break;
     }
@@ -328,7 +916,7 @@ namespace VM {
   }
 
 
-  BuiltInFunctionValue::BuiltInFunctionValue(GC::CollectedHeap& heap, int t) : AbstractFunctionValue(heap) {
+  BuiltInFunctionValue::BuiltInFunctionValue(GC::CollectedHeap& heap, int t) : AbstractFunctionValue(heap, PointerKind::BuiltInFunction) {
     heap.increaseSize(size());
     type = static_cast<BuiltInFunctionType>(t);
   }
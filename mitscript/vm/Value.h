@@ -10,6 +10,7 @@
 #include "../gc/CollectedHeap.h"
 #include "../gc/Collectable.h"
 #include "InterpreterException.h"
+#include "Shape.h"
 #include "Value.fwd.h"
 
 #define _INTEGER_TAG 0x0
@@ -19,9 +20,20 @@
 #define _STRING_TAG 0x3
 #define _POINTER_TAG 0x4
 
+// Contents of a global slot that has not been assigned yet, never seen by programs
+#define _UNINITIALIZED_VALUE (0x8 | _NONE_TAG)
+
 #define _STRING_CONSTANT_TAG _STRING_TAG
 #define _STRING_VALUE_TAG (_POINTER_TAG | _STRING_TAG)
 
+// Strings of at most SMALL_STRING_MAX bytes held in the word itself: the
+// length in bits 3 to 7 and the characters in the bytes above, zero padded
+#define _SMALL_STRING_TAG 0x6
+#define SMALL_STRING_MAX 7
+
+// Concatenations no longer than this are copied into one flat string instead of making a tree node
+#define ROPE_FLAT_MAX 32
+
 namespace VM {
   struct Interpreter;
 
@@ -36,12 +48,48 @@ namespace VM {
   #define __IS_STRING_CONSTANT_VALUE(value) ((value & _VALUE_MASK) == _STRING_CONSTANT_TAG)
   #define __IS_STRING_VALUE(value) ((value & _VALUE_MASK) == _STRING_VALUE_TAG)
 
-  #define __IS_POINTER_VALUE(value) ((value & _POINTER_TAG) == _POINTER_TAG)
-  #define __IS_STRING(value) ((value & _STRING_TAG) == _STRING_TAG)
+  #define __IS_SMALL_STRING_VALUE(value) ((value & _VALUE_MASK) == _SMALL_STRING_TAG)
+
+  // Classes of tags are sets of tag bits, so a test is a shift and a mask
+  #define __HAS_TAG_IN(value, tags) (((tags) >> (value & _VALUE_MASK)) & 1)
+  #define _POINTER_TAGS ((1 << _POINTER_TAG) | (1 << _STRING_VALUE_TAG))
+  #define _STRING_TAGS ((1 << _STRING_CONSTANT_TAG) | (1 << _STRING_VALUE_TAG) | (1 << _SMALL_STRING_TAG))
+
+  #define __IS_POINTER_VALUE(value) __HAS_TAG_IN(value, _POINTER_TAGS)
+  #define __IS_STRING(value) __HAS_TAG_IN(value, _STRING_TAGS)
+
+  // Kind tag of every PointerValue, so type checks are a byte compare that
+  // compiled code can do too. Functions come last so that checking for any
+  // AbstractFunctionValue is a single compare
+  enum class PointerKind : uint8_t {
+    String,
+    Record,
+    Reference,
+    BareFunction,
+    ClosureFunction,
+    BuiltInFunction
+  };
+
+  // Where Value::write puts the characters of a value, a run at a time
+  struct CharSink {
+    virtual void append(const char* chars, size_t length) = 0;
+
+    void append(const std::string& chars) {
+      append(chars.data(), chars.length());
+    }
+  };
 
   struct PointerValue : GC::Collectable {
-    PointerValue(GC::CollectedHeap& heap) : GC::Collectable(heap) {};
+    // Used by compiled code to read the kind tag
+    static const int32_t kind_offset;
+
+    PointerValue(GC::CollectedHeap& heap, PointerKind kind) : GC::Collectable(heap, static_cast<uint8_t>(kind)) {};
     virtual std::string toString() = 0;
+    // The characters of toString(), which subclasses can give without building it
+    virtual void write(CharSink& sink) { sink.append(toString()); }
+
+    PointerKind pointer_kind() const { return static_cast<PointerKind>(kind); }
+    static bool has_kind(PointerKind kind) { return true; }
   };
 
   struct Value {
@@ -72,10 +120,18 @@ namespace VM {
       return __IS_STRING_VALUE(value);
     }
 
+    bool isSmallString() const {
+      return __IS_SMALL_STRING_VALUE(value);
+    }
+
     bool isString() const {
       return __IS_STRING(value);
     }
 
+    bool isUninitialized() const {
+      return value == _UNINITIALIZED_VALUE;
+    }
+
     bool getBoolean() const {
       if (unlikely(!__IS_BOOLEAN_VALUE(value))) {
         throw IllegalCastException("Value is not a boolean");
@@ -97,6 +153,10 @@ namespace VM {
       return reinterpret_cast<const char*>(value & ~_VALUE_MASK);
     }
 
+    size_t getSmallStringLength() const {
+      return (value >> 3) & 0x1f;
+    }
+
     PointerValue* getPointerValue() const {
       if (unlikely(!__IS_POINTER_VALUE(value))) {
         throw IllegalCastException("Can't cast this value to a pointer type.");
@@ -106,25 +166,41 @@ namespace VM {
 
     template<typename T>
     T* getPointer() const {
-      if (T* t = dynamic_cast<T*>(getPointerValue())) {
-        return t;
+      PointerValue* pointer = getPointerValue();
+      if (unlikely(!T::has_kind(pointer->pointer_kind()))) {
+        throw IllegalCastException("Can't cast the pointer to the needed type");
       }
-      throw IllegalCastException("Can't cast the pointer to the needed type");
+      return static_cast<T*>(pointer);
     }
 
     std::string toString() const;
+    void write(CharSink& sink) const;
 
+    // Equal words are always equal values, and the only different words that
+    // can be equal are two strings
     bool operator==(Value other) {
+      if (value == other.value) {
+        return true;
+      }
       if (__IS_STRING(value) && __IS_STRING(other.value)) {
-        return toString() == other.toString(); // TODO: Make this faster
+        return stringEquals(other);
       }
-      return value == other.value;
+      return false;
     }
 
+    // Compares two strings of different words without flattening either
+    bool stringEquals(Value other) const;
+    // Number of characters in toString(), without building it for strings
+    size_t stringLength() const;
+
     static Value makeNone() {
       return Value(_NONE_TAG);
     }
 
+    static Value makeUninitialized() {
+      return Value(_UNINITIALIZED_VALUE);
+    }
+
     static Value makeBoolean(bool value) {
       return Value(_BOOLEAN_TAG | (static_cast<uint64_t>(value) << 3));
     }
@@ -144,36 +220,120 @@ namespace VM {
     static Value makeStringConstant(const char* value) {
       return Value(reinterpret_cast<uint64_t>(value) | _STRING_CONSTANT_TAG);
     }
+
+    // length must be at most SMALL_STRING_MAX
+    static Value makeSmallString(const char* chars, size_t length) {
+      uint64_t value = 0;
+      memcpy(reinterpret_cast<char*>(&value) + 1, chars, length);
+      return Value(value | (length << 3) | _SMALL_STRING_TAG);
+    }
+
+    // Both must be small strings whose lengths add up to at most SMALL_STRING_MAX
+    static Value concatSmallStrings(Value left, Value right) {
+      size_t left_length = left.getSmallStringLength();
+      uint64_t chars = (left.value >> 8) | ((right.value >> 8) << (8 * left_length));
+      return Value((chars << 8) | ((left_length + right.getSmallStringLength()) << 3) | _SMALL_STRING_TAG);
+    }
   };
 
+  // A string, either flat in memory (height 0) or a tree node, a rope, whose
+  // characters are those of left followed by those of right. Trees are kept
+  // balanced by concat, and reading one with toString flattens it for good
   struct StringValue : public PointerValue {
     size_t height;
     char* memory;
+    // Of the whole string, for trees too
     size_t length;
     Value left;
     Value right;
+    size_t hash_code = 0;
+    bool hashed = false;
 
     StringValue(GC::CollectedHeap& heap, const std::string& value);
+    StringValue(GC::CollectedHeap& heap, const char* chars, size_t length);
     StringValue(GC::CollectedHeap& heap, const Value l, const Value r);
     ~StringValue();
 
+    static bool has_kind(PointerKind kind) { return kind == PointerKind::String; }
+
+    // Hash of the characters, computed on first use without flattening the tree
+    size_t hash();
+    // Turns a tree node into a flat string, letting go of its children
+    void flatten();
+
+    // left followed by right as a string, balancing the tree it builds
+    static Value concat(GC::CollectedHeap& heap, Value left, Value right);
+
     std::string toString();
+    void write(CharSink& sink);
     virtual size_t size();
-    virtual void markChildren(uint32_t generation, bool mark_recent_only);
+    virtual void markChildren();
+    virtual void evacuateChildren();
+  };
+
+  // Walks the characters of a value as a string one run at a time, going
+  // through string trees left to right instead of flattening them
+  class StringChunks {
+    std::vector<Value> pending;
+    // Holds the characters of values that have no storage to point into
+    char scratch[24];
+
+  public:
+    StringChunks(Value value) : pending{value} {}
+
+    // Sets chunk to the next non-empty run of characters, valid until the
+    // next call. False once the string is exhausted
+    bool next(const char*& chunk, size_t& length);
   };
 
   struct RecordValue : public PointerValue {
-    std::unordered_map<std::string, Value> values;
+    // Used by compiled code, the offsets of the fields it reads
+    static const int32_t shape_offset;
+    static const int32_t slots_offset;
+    static const int32_t elements_offset;
+    static const int32_t element_count_offset;
+
+    // nullptr once the record is in dictionary mode
+    Shape* shape;
+    Value slots[RECORD_INLINE_SLOTS];
+    std::vector<Value> overflow;
+    // Values of the keys 0 .. element_count - 1, for records used as arrays
+    Value* elements = nullptr;
+    size_t element_count = 0;
+    size_t element_capacity = 0;
+    // Non-negative integer keys past the end of elements
+    std::unique_ptr<std::unordered_map<size_t, Value>> sparse_elements;
+    // Fields of a record that has outgrown the shape tree
+    std::unique_ptr<std::unordered_map<BC::Atom, Value>> dictionary;
 
     RecordValue(GC::CollectedHeap& heap);
     ~RecordValue();
 
-    Value get(std::string key);
-    void insert(std::string key, Value inserted);
+    static bool has_kind(PointerKind kind) { return kind == PointerKind::Record; }
+
+    Value get(const std::string& key);
+    void insert(const std::string& key, Value inserted);
+    Value get(BC::FieldCache& cache);
+    void insert(BC::FieldCache& cache, Value inserted);
+    Value get(Value index);
+    void insert(Value index, Value inserted);
 
     std::string toString();
+    void write(CharSink& sink);
     virtual size_t size();
-    virtual void markChildren(uint32_t generation, bool mark_recent_only);
+    virtual void markChildren();
+    virtual void evacuateChildren();
+
+  private:
+    Value& slot(uint32_t index);
+    Value get_field(BC::Atom key);
+    void insert_field(BC::Atom key, Value inserted);
+    void add_field(Shape* next, Value inserted);
+    Value get_element(size_t index);
+    void append_element(Value inserted);
+    void insert_element(size_t index, Value inserted);
+    void make_dictionary();
+    void write_barrier(Value inserted);
   };
 
   struct ReferenceValue : public PointerValue {
@@ -182,18 +342,25 @@ namespace VM {
     ReferenceValue(GC::CollectedHeap& heap, Value v);
     ~ReferenceValue();
 
+    static bool has_kind(PointerKind kind) { return kind == PointerKind::Reference; }
+
     void write(Value v);
 
     std::string toString();
     virtual size_t size();
-    virtual void markChildren(uint32_t generation, bool mark_recent_only);
+    virtual void markChildren();
+    virtual void evacuateChildren();
   };
 
   struct AbstractFunctionValue : public PointerValue {
-    AbstractFunctionValue(GC::CollectedHeap& heap) : PointerValue(heap) {}
+    AbstractFunctionValue(GC::CollectedHeap& heap, PointerKind kind) : PointerValue(heap, kind) {}
+
+    static bool has_kind(PointerKind kind) { return kind >= PointerKind::BareFunction; }
 
     std::string toString();
-    virtual Value call(std::vector<Value> & arguments) = 0;
+    // arguments points at argc values. When they end at interpreter->stack_top
+    // they are used in place as the callee's first locals
+    virtual Value call(Value* arguments, size_t argc) = 0;
   };
 
   struct BareFunctionValue : public AbstractFunctionValue {
@@ -202,9 +369,12 @@ namespace VM {
     BareFunctionValue(GC::CollectedHeap& heap, std::shared_ptr<BC::Function> value);
     ~BareFunctionValue();
 
-    Value call(std::vector<Value> & arguments);
+    static bool has_kind(PointerKind kind) { return kind == PointerKind::BareFunction; }
+
+    Value call(Value* arguments, size_t argc);
     virtual size_t size() { return sizeof(BareFunctionValue); }
-    virtual void markChildren(uint32_t generation, bool mark_recent_only) {}
+    virtual void markChildren() {}
+    virtual void evacuateChildren() {}
   };
 
   struct ClosureFunctionValue : public AbstractFunctionValue {
@@ -214,11 +384,14 @@ namespace VM {
     ClosureFunctionValue(GC::CollectedHeap& heap, std::shared_ptr<BC::Function> value);
     ~ClosureFunctionValue();
 
+    static bool has_kind(PointerKind kind) { return kind == PointerKind::ClosureFunction; }
+
     void add_reference(ReferenceValue* reference);
 
-    Value call(std::vector<Value> & arguments);
+    Value call(Value* arguments, size_t argc);
     virtual size_t size();
-    virtual void markChildren(uint32_t generation, bool mark_recent_only);
+    virtual void markChildren();
+    virtual void evacuateChildren();
   };
 
   enum class BuiltInFunctionType {
@@ -229,13 +402,19 @@ namespace VM {
   };
 
   struct BuiltInFunctionValue : public AbstractFunctionValue {
+    // Used by compiled code to recognize intcast
+    static const int32_t type_offset;
+
     BuiltInFunctionType type;
 
     BuiltInFunctionValue(GC::CollectedHeap& heap, int t);
     ~BuiltInFunctionValue();
 
-    Value call(std::vector<Value> & arguments);
+    static bool has_kind(PointerKind kind) { return kind == PointerKind::BuiltInFunction; }
+
+    Value call(Value* arguments, size_t argc);
     virtual size_t size() { return sizeof(BuiltInFunctionValue); }
-    virtual void markChildren(uint32_t generation, bool mark_recent_only) {}
+    virtual void markChildren() {}
+    virtual void evacuateChildren() {}
   };
 }
@@ -0,0 +1,46 @@
+#include "constants.h"
+
+#include <memory>
+#include <unordered_map>
+
+namespace VM {
+  static std::unordered_map<std::string, std::unique_ptr<char[]>> constant_strings;
+
+  const char* intern_constant(const std::string& value) {
+    auto it = constant_strings.find(value);
+    if (it != constant_strings.end()) {
+      return it->second.get();
+    }
+    char* storage = new char[value.length() + 1];
+    memcpy(storage, value.c_str(), value.length() + 1);
+    constant_strings.emplace(value, std::unique_ptr<char[]>(storage));
+    return storage;
+  }
+
+  static Value constant_to_value(std::shared_ptr<BC::Constant> constant) {
+    if (std::shared_ptr<BC::None> c = std::dynamic_pointer_cast<BC::None>(constant)) {
+      return Value::makeNone();
+    }
+    if (std::shared_ptr<BC::Integer> c = std::dynamic_pointer_cast<BC::Integer>(constant)) {
+      return Value::makeInteger(c->value);
+    }
+    if (std::shared_ptr<BC::String> c = std::dynamic_pointer_cast<BC::String>(constant)) {
+      return Value::makeStringConstant(intern_constant(c->value));
+    }
+    if (std::shared_ptr<BC::Boolean> c = std::dynamic_pointer_cast<BC::Boolean>(constant)) {
+      return Value::makeBoolean(c->value);
+    }
+    throw RuntimeException("Tried to convert a Function to a Value in constant_to_value (usually called from LoadConst) - should be done in LoadFunc");
+  }
+
+  void load_constants(BC::Function& func) {
+    func.constant_values.clear();
+    func.constant_values.reserve(func.constants_.size());
+    for (auto constant : func.constants_) {
+      func.constant_values.push_back(constant_to_value(constant).value);
+    }
+    for (auto function : func.functions_) {
+      load_constants(*function);
+    }
+  }
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "Value.h"
+
+namespace VM {
+  // Returns a copy of value that lives for the rest of the program, suitable
+  // for Value::makeStringConstant. Equal strings share the same storage.
+  const char* intern_constant(const std::string& value);
+
+  // Materializes func.constants_ (and those of every nested function) into
+  // func.constant_values, so loading a constant is a plain array read.
+  void load_constants(BC::Function& func);
+}
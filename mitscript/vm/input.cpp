@@ -0,0 +1,92 @@
+#include "input.h"
+
+#include <cctype>
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace VM {
+  Input input;
+
+  Input::~Input() {
+    if (mapped) {
+      munmap(const_cast<char*>(window), limit);
+    }
+  }
+
+  void Input::open() {
+    opened = true;
+    struct stat info;
+    if (fstat(STDIN_FILENO, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+      off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+      void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+      if (data != MAP_FAILED && offset >= 0) {
+        madvise(data, info.st_size, MADV_SEQUENTIAL);
+        mapped = true;
+        window = static_cast<const char*>(data);
+        position = offset;
+        limit = info.st_size;
+        return;
+      }
+      if (data != MAP_FAILED) {
+        munmap(data, info.st_size);
+      }
+    }
+    buffer.resize(BLOCK);
+    window = buffer.data();
+  }
+
+  // Reads the next block, keeping the characters from keep on, which move
+  // to the start of the buffer. False at the end of input
+  bool Input::refill(size_t& keep) {
+    if (mapped) {
+      return false;
+    }
+    size_t kept = limit - keep;
+    memmove(buffer.data(), buffer.data() + keep, kept);
+    position -= keep;
+    keep = 0;
+    limit = kept;
+    if (limit == buffer.size()) {
+      // A word longer than the buffer
+      buffer.resize(buffer.size() * 2);
+    }
+    window = buffer.data();
+    ssize_t count;
+    do {
+      count = ::read(STDIN_FILENO, buffer.data() + limit, buffer.size() - limit);
+    } while (count < 0 && errno == EINTR);
+    if (count <= 0) {
+      return false;
+    }
+    limit += count;
+    return true;
+  }
+
+  void Input::next_word(const char*& word, size_t& length) {
+    if (!opened) {
+      open();
+    }
+    while (true) {
+      while (position < limit && isspace(static_cast<unsigned char>(window[position]))) {
+        position++;
+      }
+      if (position < limit || !refill(position)) {
+        break;
+      }
+    }
+    size_t start = position;
+    while (true) {
+      while (position < limit && !isspace(static_cast<unsigned char>(window[position]))) {
+        position++;
+      }
+      if (position < limit || !refill(start)) {
+        break;
+      }
+    }
+    word = window + start;
+    length = position - start;
+  }
+}
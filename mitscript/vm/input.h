@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace VM {
+  // Standard input of programs, split into the whitespace separated words
+  // input() returns. A regular file is mapped whole, anything else is read
+  // in large blocks, and words are handed out in place
+  class Input {
+    static const size_t BLOCK = 1 << 16;
+
+    bool opened = false;
+    bool mapped = false;
+    const char* window = nullptr;
+    size_t position = 0;
+    size_t limit = 0;
+    std::vector<char> buffer;
+
+    void open();
+    bool refill(size_t& keep);
+
+  public:
+    ~Input();
+
+    // Sets word to the next word, valid until the next call. Empty at the end of input
+    void next_word(const char*& word, size_t& length);
+  };
+
+  extern Input input;
+}
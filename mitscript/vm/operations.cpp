@@ -1,11 +1,42 @@
 #include "operations.h"
 #include "globals.h"
+#include <cctype>
+#include <climits>
 
 namespace VM {
+    Value make_string(const std::string& value) {
+        return make_string(value.data(), value.length());
+    }
+
+    Value make_string(const char* chars, size_t length) {
+        if (length <= SMALL_STRING_MAX) {
+            return Value::makeSmallString(chars, length);
+        }
+        return Value::makeString(interpreter->heap.allocate<StringValue>(chars, length));
+    }
+
+    // Length of value as a string when it is short enough to be part of a
+    // small string and that can be told without allocating, otherwise more
+    static size_t short_length(Value value) {
+        if (value.isSmallString()) {
+            return value.getSmallStringLength();
+        } else if (value.isPointer()) {
+            return SMALL_STRING_MAX + 1;
+        } else if (value.isString()) {
+            return strnlen(value.getStringConstant(), SMALL_STRING_MAX + 1);
+        }
+        return value.toString().length();
+    }
+
     Value add(Value left, Value right) {
         if (right.isString() || left.isString()) {
-            if (has_optimization(OPTIMIZATION_STRING_TREES)) {
-                return Value::makeString(interpreter->heap.allocate<StringValue>(left, right));
+            if (short_length(left) + short_length(right) <= SMALL_STRING_MAX) {
+                if (left.isSmallString() && right.isSmallString()) {
+                    return Value::concatSmallStrings(left, right);
+                }
+                return make_string(left.toString() + right.toString());
+            } else if (has_optimization(OPTIMIZATION_STRING_TREES)) {
+                return StringValue::concat(interpreter->heap, left, right);
             } else {
                 return Value::makeString(interpreter->heap.allocate<StringValue>(left.toString() + right.toString()));
             }
@@ -16,6 +47,43 @@ namespace VM {
         }
     }
 
+    // Reads the characters in place, a chunk at a time, so ropes aren't flattened
+    Value intcast(Value string) {
+        if (!string.isString()) {
+            throw IllegalCastException("A string wasn't passed to intcast");
+        }
+        StringChunks chunks(string);
+        const char* chunk;
+        size_t length;
+        bool started = false;
+        bool negative = false;
+        bool finished = false;
+        uint64_t magnitude = 0;
+        // What strtol saturates at, which atoi then truncates to an int
+        uint64_t limit = LONG_MAX;
+        while (!finished && chunks.next(chunk, length)) {
+            for (size_t i = 0; i < length; i++) {
+                unsigned char c = chunk[i];
+                if (!started && isspace(c)) {
+                    continue;
+                } else if (!started && (c == '-' || c == '+')) {
+                    started = true;
+                    negative = c == '-';
+                    limit = negative ? static_cast<uint64_t>(LONG_MAX) + 1 : LONG_MAX;
+                    continue;
+                } else if (!isdigit(c)) {
+                    finished = true;
+                    break;
+                }
+                started = true;
+                uint64_t digit = c - '0';
+                magnitude = magnitude > (limit - digit) / 10 ? limit : magnitude * 10 + digit;
+            }
+        }
+        int64_t value = negative ? static_cast<int64_t>(0 - magnitude) : static_cast<int64_t>(magnitude);
+        return Value::makeInteger(static_cast<int>(value));
+    }
+
     Value equals(Value left, Value right) {
         return Value::makeBoolean(left == right);
     }
@@ -11,7 +11,30 @@ namespace VM {
         throw RuntimeException("Tried to access an index out of bounds.");
     }
 
+    // Creates the inline cache of a field access to func.names_[name], returning
+    // its index in func.field_caches, or -1 if there is no such name. Inline so
+    // the ir tool can lower field accesses without the rest of the runtime.
+    inline int32_t add_field_cache(BC::Function& func, int32_t name) {
+      if (name < 0 || name >= static_cast<int32_t>(func.names_.size())) {
+        return -1;
+      }
+      func.field_caches.emplace_back(func.names_[name]);
+      return func.field_caches.size() - 1;
+    }
+
+    inline BC::FieldCache& field_cache(BC::Function& func, int32_t index) {
+      if (index >= 0 && index < static_cast<int32_t>(func.field_caches.size())) {
+        return func.field_caches[index];
+      }
+      throw RuntimeException("Tried to access an index out of bounds.");
+    }
+
     Value allocateFunction(ClosureFunctionValue* closure, int index);
+    // A small string if value fits in one, otherwise a new StringValue
+    Value make_string(const std::string& value);
+    Value make_string(const char* chars, size_t length);
     Value add(Value left, Value right);
+    // The number a string starts with, as atoi reads it
+    Value intcast(Value string);
     Value equals(Value left, Value right);
 }
\ No newline at end of file
@@ -0,0 +1,62 @@
+#include "output.h"
+
+#include <unistd.h>
+#include <errno.h>
+
+namespace VM {
+  Output output;
+
+  static void write_all(const char* chars, size_t length) {
+    while (length > 0) {
+      ssize_t written = ::write(STDOUT_FILENO, chars, length);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      } else if (written <= 0) {
+        return;
+      }
+      chars += written;
+      length -= written;
+    }
+  }
+
+  Output::~Output() {
+    flush();
+  }
+
+  void Output::set_policy(FlushPolicy policy, size_t flush_bytes) {
+    this->policy = policy;
+    this->flush_bytes = flush_bytes < CAPACITY ? flush_bytes : CAPACITY;
+  }
+
+  void Output::append(const char* chars, size_t length) {
+    if (used + length > CAPACITY) {
+      flush();
+      if (length > CAPACITY) {
+        // Too big to buffer, so it goes out as it is
+        write_all(chars, length);
+        return;
+      }
+    }
+    memcpy(buffer + used, chars, length);
+    used += length;
+  }
+
+  void Output::print(Value value) {
+    value.write(*this);
+    append("\n", 1);
+    if (policy == FlushPolicy::Bytes && used >= flush_bytes) {
+      flush();
+    }
+  }
+
+  void Output::input_requested() {
+    if (policy == FlushPolicy::Input) {
+      flush();
+    }
+  }
+
+  void Output::flush() {
+    write_all(buffer, used);
+    used = 0;
+  }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "Value.h"
+
+namespace VM {
+  // When buffered output is written out, besides whenever the buffer fills up
+  // and at exit
+  enum class FlushPolicy {
+    // Never otherwise
+    Exit,
+    // Before input() reads, so prompts show up first
+    Input,
+    // Once a print leaves at least flush_bytes in the buffer
+    Bytes
+  };
+
+  // Standard output of programs. print serializes values straight into a
+  // large buffer, which goes out with one write call at a time
+  class Output : public CharSink {
+    static const size_t CAPACITY = 1 << 16;
+
+    char buffer[CAPACITY];
+    size_t used = 0;
+    FlushPolicy policy = FlushPolicy::Input;
+    size_t flush_bytes = CAPACITY;
+
+  public:
+    ~Output();
+
+    void set_policy(FlushPolicy policy, size_t flush_bytes = CAPACITY);
+
+    void append(const char* chars, size_t length);
+    using CharSink::append;
+
+    // Writes value and a newline, like the print builtin
+    void print(Value value);
+    // Called before the program reads from standard input
+    void input_requested();
+    void flush();
+  };
+
+  extern Output output;
+}
@@ -6,10 +6,13 @@
 #include "../bccompiler/Compiler.h"
 #include "Interpreter.h"
 #include "globals.h"
+#include "output.h"
 #include "mem.h"
 #include <iostream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
 #include <getopt.h>
 #include <sys/time.h>
 #include <sys/resource.h>
@@ -21,6 +24,21 @@ using namespace std;
 
 enum Mode {SOURCE, BYTECODE};
 
+// Reads a whole option argument as a non-negative number
+static bool parse_count(const char* text, size_t& count) {
+  if (!isdigit(static_cast<unsigned char>(text[0]))) {
+    return false;
+  }
+  char* end;
+  errno = 0;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (*end != '\0' || errno == ERANGE) {
+    return false;
+  }
+  count = value;
+  return true;
+}
+
 int main(int argc, char** argv)
 {
   bool print_memory = false;
@@ -43,6 +61,9 @@ int main(int argc, char** argv)
         {"memory-usage",      no_argument,       0, 'u'},
         {"memory-trace",      no_argument,       0, 't'},
         {"compile-errors",    no_argument,       0, 'e'},
+        {"profile-opcodes",   no_argument,       0, 'p'},
+        {"flush",             required_argument, 0, 'f'},
+        {"gc-threads",        required_argument, 0, 'g'},
         {0, 0, 0, 0}
       };
     int OPTIMIZATION_index = 0;
@@ -73,8 +94,15 @@ int main(int argc, char** argv)
           set_optimization(OPTIMIZATION_COMPILE_ONLY);
         } else if (strcmp(optarg, "gc-generational") == 0) {
           set_optimization(OPTIMIZATION_GC_GENERATIONAL);
+        } else if (strcmp(optarg, "register-vm") == 0) {
+          set_optimization(OPTIMIZATION_REGISTER_VM);
+        } else if (strcmp(optarg, "gc-background-sweep") == 0) {
+          set_optimization(OPTIMIZATION_GC_BACKGROUND_SWEEP);
+        } else if (strcmp(optarg, "superinstructions") == 0) {
+          set_optimization(OPTIMIZATION_SUPERINSTRUCTIONS);
         } else if (strcmp(optarg, "all") == 0) {
           set_optimization(OPTIMIZATION_MACHINE_CODE);
+          set_optimization(OPTIMIZATION_SUPERINSTRUCTIONS);
           set_optimization(OPTIMIZATION_GC_GENERATIONAL);
           set_optimization(OPTIMIZATION_OPTIMIZATION_PASSES);
         }
@@ -88,6 +116,35 @@ int main(int argc, char** argv)
       case 'e':
         set_option(OPTION_COMPILE_ERRORS);
         break;
+      case 'p':
+        set_option(OPTION_PROFILE_OPCODES);
+        break;
+      case 'f':
+        // exit, input (the default), or a number of bytes
+        if (strcmp(optarg, "exit") == 0) {
+          VM::output.set_policy(VM::FlushPolicy::Exit);
+        } else if (strcmp(optarg, "input") == 0) {
+          VM::output.set_policy(VM::FlushPolicy::Input);
+        } else {
+          size_t bytes;
+          if (!parse_count(optarg, bytes)) {
+            cout << "error: --flush takes exit, input or a number of bytes, not " << optarg << endl;
+            return 1;
+          }
+          VM::output.set_policy(VM::FlushPolicy::Bytes, bytes);
+        }
+        break;
+      case 'g':
+      {
+        // Threads marking in full collections
+        size_t threads;
+        if (!parse_count(optarg, threads) || threads == 0) {
+          cout << "error: --gc-threads takes a positive number of threads, not " << optarg << endl;
+          return 1;
+        }
+        set_gc_threads(threads);
+        break;
+      }
       case '?':
         break;
       default:
@@ -161,6 +218,7 @@ int main(int argc, char** argv)
         std::rethrow_exception(eptr);
       }
     } catch (SystemException& ex) {
+      VM::output.flush();
       cout << ex.what() << endl;
       exit(1);
     }
@@ -175,6 +233,10 @@ int main(int argc, char** argv)
   // cout << "Vector: " << sizeof(std::vector<const char*>) << endl;
 
   int result = interpreter->interpret();
+  VM::output.flush();
+  if (has_option(OPTION_PROFILE_OPCODES)) {
+    interpreter->print_opcode_profile(cerr);
+  }
   if (has_option(OPTION_SHOW_MEMORY_USAGE)) {
     struct rusage usage;
     getrusage(RUSAGE_SELF, &usage);